@@ -2,12 +2,54 @@
 #include <vector>      // Used for dynamic list of sources and loads
 #include <map>         // For mapping component names to breakers
 #include <set>         // For managing fault names
+#include <deque>       // Bounded undo/redo history
 #include <string>
 #include <cstdlib>
 #include <ctime>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <memory>
+#include <mutex>       // Guards state shared with the Modbus server thread
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <fstream>
+#include <streambuf>
+#include <limits>
+#include <random>
+#include <queue>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>   // Component behaviors; build with -std=c++20
+#define SMARTGRID_COROUTINES 1
+#endif
+#include <sys/socket.h> // POSIX sockets for the Modbus TCP server
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>   // Worker core pinning
+#include <sys/mman.h>  // Memory-mapped flight recorder
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/perf_event.h>  // Hardware counters for --perf
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 namespace SmartGrid {  //  Namespace usage
 
@@ -36,7 +78,10 @@ protected:
 public:
     PowerComponent(const std::string& n) : name(n), status(true) {}
     virtual ~PowerComponent() {}  // Virtual destructor
-    virtual void simulate() = 0;  // Pure virtual function (abstract class)
+    virtual void simulate(std::ostream& os) = 0;  // Pure virtual function (abstract class)
+    virtual std::shared_ptr<PowerComponent> clone() const = 0;  // Copy for a diverging grid branch
+    virtual bool fluctuates() const { return false; }  // Output may change between cycles on its own
+    virtual bool isSolar() const { return false; }     // Weather-driven output, outside the grid's control
     std::string getName() const { return name; }
     bool isConnected() const { return status; }
     void disconnect() { status = false; }
@@ -52,239 +97,5274 @@ protected:
     bool renewable;
 public:
     PowerSource(const std::string& n, float p, bool r) : PowerComponent(n), powerOutput(p), renewable(r) {}
-    void simulate() override {  // Overridden method for polymorphism
+    void simulate(std::ostream& os) override {  // Overridden method for polymorphism
         if (status)
-            std::cout << "[Source] " << name << " generating " << powerOutput << "kW\n";
+            os << "[Source] " << name << " generating " << powerOutput << "kW\n";
     }
+    std::shared_ptr<PowerComponent> clone() const override { return std::make_shared<PowerSource>(*this); }
     float getPowerOutput() const { return powerOutput; }
+    void setPowerOutput(float p) { powerOutput = p; }  // Solar sources redraw theirs every cycle
 };
 
+// -------------------------
+// Random Draws for Fluctuating Sources
+// -------------------------
+// The simulation thread uses std::rand so --seed reproduces whole sessions.
+// Worker threads install their own generator, so parallel jobs are
+// deterministic and do not disturb the global sequence.
+inline std::minstd_rand*& threadRng() {
+    thread_local std::minstd_rand* rng = nullptr;
+    return rng;
+}
+
+inline int drawRandom() {
+    std::minstd_rand* rng = threadRng();
+    return rng ? static_cast<int>((*rng)() & 0x7FFFFFFF) : std::rand();
+}
+
 // -------------------------
 // Further Derived Class: SolarSource
 // -------------------------
 class SolarSource : public PowerSource {
 public:
-    SolarSource(const std::string& n) : PowerSource(n, 50.0f, true) {}
-    void simulate() override {
-        if (status) {
-            powerOutput = 20 + std::rand() % 30;  // Fluctuating behavior
-            std::cout << "[Solar] " << name << " output: " << powerOutput << "kW\n";
+    SolarSource(const std::string& n) : PowerSource(n, 50.0f, true) {}
+    void simulate(std::ostream& os) override {
+        if (status) {
+            powerOutput = static_cast<float>(20 + drawRandom() % 30);  // Fluctuating behavior
+            os << "[Solar] " << name << " output: " << powerOutput << "kW\n";
+        }
+    }
+    std::shared_ptr<PowerComponent> clone() const override { return std::make_shared<SolarSource>(*this); }
+    bool fluctuates() const override { return true; }
+    bool isSolar() const override { return true; }
+};
+
+// -------------------------
+// Further Derived Class: RampedSource
+// -------------------------
+// A dispatchable unit, such as a gas turbine, whose output moves at most
+// rampKW per cycle. It starts cold and is steered by the grid's dispatcher.
+class RampedSource : public PowerSource {
+    float maxKW, rampKW, costPerKW;  // Cost of one kW for one cycle
+public:
+    RampedSource(const std::string& n, float maxKW, float rampKW, float costPerKW)
+        : PowerSource(n, 0.0f, false), maxKW(maxKW), rampKW(rampKW), costPerKW(costPerKW) {}
+    void simulate(std::ostream& os) override {
+        if (status)
+            os << "[Ramped] " << name << " generating " << powerOutput << "kW of " << maxKW << "kW\n";
+    }
+    std::shared_ptr<PowerComponent> clone() const override { return std::make_shared<RampedSource>(*this); }
+    // Moves toward targetKW as far as the ramp allows and returns the new output
+    float dispatch(float targetKW) {
+        targetKW = std::min(std::max(targetKW, 0.0f), maxKW);
+        powerOutput = std::min(std::max(targetKW, powerOutput - rampKW), powerOutput + rampKW);
+        return powerOutput;
+    }
+    float getMaxKW() const { return maxKW; }
+    float getRampKW() const { return rampKW; }
+    float getCost() const { return costPerKW; }
+};
+
+// -------------------------
+// Further Derived Class: StorageUnit
+// -------------------------
+// A battery. Positive output discharges it and negative output charges it.
+// Energy is counted in kW-cycles, the energy of one kW for one cycle, and
+// moves when the cycle simulates the unit.
+class StorageUnit : public PowerSource {
+    float capacity, rateKW, stored;
+public:
+    StorageUnit(const std::string& n, float capacity, float rateKW, float stored)
+        : PowerSource(n, 0.0f, false), capacity(capacity), rateKW(rateKW), stored(std::min(std::max(stored, 0.0f), capacity)) {}
+    void simulate(std::ostream& os) override {
+        if (!status) return;
+        powerOutput = std::min(std::max(powerOutput, stored - capacity), stored);
+        stored -= powerOutput;
+        os << "[Storage] " << name;
+        if (powerOutput != 0) os << (powerOutput < 0 ? " charging " : " discharging ") << std::fabs(powerOutput) << "kW,";
+        else os << " idle,";
+        os << " " << stored << "/" << capacity << " kW-cycles stored\n";
+    }
+    std::shared_ptr<PowerComponent> clone() const override { return std::make_shared<StorageUnit>(*this); }
+    bool fluctuates() const override { return powerOutput != 0; }  // Each cycle moves energy
+    // Requests kW (negative to charge) within the rate and the stored energy; returns the setting
+    float dispatch(float kW) {
+        kW = std::min(std::max(kW, -rateKW), rateKW);
+        powerOutput = std::min(std::max(kW, stored - capacity), stored);
+        return powerOutput;
+    }
+    float getCapacity() const { return capacity; }
+    float getRateKW() const { return rateKW; }
+    float getStored() const { return stored; }
+};
+
+// -------------------------
+// Load Class (not derived from base, supports simulation and disconnection)
+// -------------------------
+class Load {
+    std::string name;
+    float demand;
+    bool connected;
+    int priority;
+public:
+    Load(const std::string& n, float d, int p = 5) : name(n), demand(d), connected(true), priority(p) {}
+    std::string getName() const { return name; }
+    float getRawDemand() const { return demand; }
+    bool isConnected() const { return connected; }
+    int getPriority() const { return priority; }
+    void disconnect() { connected = false; }
+    void reconnect() { connected = true; }
+    void setDemand(float d) { demand = d; }
+};
+
+// -------------------------
+// Tracer: Per-thread span buffers exported as a Chrome trace
+// -------------------------
+// Each thread records into its own ring of complete events, so tracing adds no
+// locking to the hot path. When tracing is off a span costs one relaxed load.
+class Tracer {
+public:
+    struct Event {
+        const char* name;      // Must be a string literal (stored by pointer)
+        const char* category;
+        uint64_t beginNs;
+        uint64_t endNs;
+    };
+
+private:
+    struct ThreadBuffer {
+        uint32_t tid;
+        std::string threadName;
+        std::vector<Event> ring;
+        uint64_t written = 0;   // Total events recorded; ring keeps the newest
+    };
+
+    std::atomic<bool> on{false};
+    size_t capacity = 1 << 16;
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;  // Outlive their threads until export
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    ThreadBuffer& localBuffer() {
+        thread_local ThreadBuffer* local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffers.push_back(std::make_unique<ThreadBuffer>());
+            local = buffers.back().get();
+            local->tid = static_cast<uint32_t>(buffers.size());
+            local->threadName = local->tid == 1 ? "simulation" : "worker-" + std::to_string(local->tid);
+            local->ring.resize(capacity);
+        }
+        return *local;
+    }
+
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    void enable(size_t eventsPerThread = 1 << 16) {
+        capacity = eventsPerThread;
+        localBuffer();  // The enabling thread is the simulation thread
+        on = true;
+    }
+
+    uint64_t now() const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - origin).count());
+    }
+
+    void setThreadName(const std::string& name) {
+        if (enabled()) localBuffer().threadName = name;
+    }
+
+    void record(const char* name, const char* category, uint64_t beginNs, uint64_t endNs) {
+        ThreadBuffer& b = localBuffer();
+        b.ring[b.written % b.ring.size()] = {name, category, beginNs, endNs};
+        ++b.written;
+    }
+
+    // Writes the trace in Chrome JSON format (chrome://tracing, ui.perfetto.dev).
+    // Call after worker threads have stopped.
+    bool writeChromeJson(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) return false;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        bool first = true;
+        out << std::fixed << std::setprecision(3);
+        for (const auto& b : buffers) {
+            out << (first ? "" : ",\n") << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+                << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << b->threadName << "\"}}";
+            first = false;
+            uint64_t count = std::min<uint64_t>(b->written, b->ring.size());
+            for (uint64_t i = b->written - count; i < b->written; ++i) {
+                const Event& e = b->ring[i % b->ring.size()];
+                out << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid << ",\"name\":\"" << e.name
+                    << "\",\"cat\":\"" << e.category << "\",\"ts\":" << e.beginNs / 1000.0
+                    << ",\"dur\":" << (e.endNs - e.beginNs) / 1000.0 << "}";
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+};
+
+// RAII span: records [construction, destruction) when tracing is enabled
+class TraceSpan {
+    const char* name;
+    const char* category;
+    uint64_t begin;
+public:
+    TraceSpan(const char* n, const char* c) : name(n), category(c), begin(0) {
+        Tracer& t = Tracer::instance();
+        if (t.enabled()) begin = t.now();
+        else name = nullptr;
+    }
+    ~TraceSpan() {
+        if (name) {
+            Tracer& t = Tracer::instance();
+            t.record(name, category, begin, t.now());
+        }
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// -------------------------
+// PerfCounters: Hardware counter groups around cycle phases (Linux perf_event_open)
+// -------------------------
+enum class CyclePhase { Sources, Loads, Balance, Count };
+
+inline const char* phaseName(CyclePhase p) {
+    static const char* const names[] = {"sources", "loads", "balance"};
+    return names[static_cast<int>(p)];
+}
+
+class PerfCounters {
+public:
+    enum Counter { Cycles, Instructions, CacheMisses, BranchMisses, NumCounters };
+
+private:
+    struct PhaseTotals {
+        uint64_t counts[NumCounters] = {};
+        uint64_t samples = 0;
+        uint64_t items = 0;   // Components visited, for per-component figures
+    };
+
+    int fds[NumCounters] = {-1, -1, -1, -1};
+    bool active = false;
+    std::thread::id owner;  // The group counts this thread only
+    PhaseTotals phases[static_cast<int>(CyclePhase::Count)];
+
+#ifdef __linux__
+    static int openCounter(uint64_t config, int groupFd, uint32_t type = PERF_TYPE_HARDWARE) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = groupFd == -1 ? 1 : 0;  // Leader starts the whole group
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = groupFd == -2 ? 0 : PERF_FORMAT_GROUP;  // -2: standalone counter
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, std::max(groupFd, -1), 0));
+    }
+#endif
+
+public:
+    static PerfCounters& instance() {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds)
+            if (fd >= 0) ::close(fd);
+    }
+
+    bool enabled() const { return active && std::this_thread::get_id() == owner; }
+
+    // Running dTLB load-miss count for the calling thread (read one uint64_t), -1 if unavailable
+    static int openTlbMissCounter() {
+#ifdef __linux__
+        int fd = openCounter(PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -2, PERF_TYPE_HW_CACHE);
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        return fd;
+#else
+        return -1;
+#endif
+    }
+
+    // Opens one counter group for the calling (simulation) thread
+    bool enable() {
+#ifdef __linux__
+        static const uint64_t configs[NumCounters] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < NumCounters; ++i) {
+            fds[i] = openCounter(configs[i], i == 0 ? -1 : fds[0]);
+            if (fds[i] < 0) {
+                for (int j = 0; j < i; ++j) { ::close(fds[j]); fds[j] = -1; }
+                return false;
+            }
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        active = true;
+        owner = std::this_thread::get_id();
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Reads all counters of the group with a single syscall
+    bool read(uint64_t out[NumCounters]) const {
+        uint64_t buf[1 + NumCounters];
+        if (::read(fds[0], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf))) return false;
+        for (int i = 0; i < NumCounters; ++i)
+            out[i] = buf[1 + i];
+        return true;
+    }
+
+    void accumulate(CyclePhase p, const uint64_t begin[NumCounters], const uint64_t end[NumCounters], size_t items) {
+        PhaseTotals& t = phases[static_cast<int>(p)];
+        for (int i = 0; i < NumCounters; ++i)
+            t.counts[i] += end[i] - begin[i];
+        ++t.samples;
+        t.items += items;
+    }
+
+    void report(std::ostream& os) const {
+        os << "\n[Perf Counters]\n";
+        os << std::left << std::setw(10) << "phase" << std::right << std::setw(8) << "cycles"
+           << std::setw(14) << "cpu-cycles" << std::setw(14) << "instructions" << std::setw(7) << "IPC"
+           << std::setw(14) << "cache-misses" << std::setw(14) << "branch-misses"
+           << std::setw(14) << "cycles/comp" << std::setw(14) << "misses/comp" << "\n";
+        for (int p = 0; p < static_cast<int>(CyclePhase::Count); ++p) {
+            const PhaseTotals& t = phases[p];
+            double ipc = t.counts[Cycles] ? static_cast<double>(t.counts[Instructions]) / t.counts[Cycles] : 0.0;
+            double perItemCycles = t.items ? static_cast<double>(t.counts[Cycles]) / t.items : 0.0;
+            double perItemMisses = t.items ? static_cast<double>(t.counts[CacheMisses]) / t.items : 0.0;
+            os << std::left << std::setw(10) << phaseName(static_cast<CyclePhase>(p)) << std::right
+               << std::setw(8) << t.samples << std::setw(14) << t.counts[Cycles]
+               << std::setw(14) << t.counts[Instructions] << std::setw(7) << std::fixed << std::setprecision(2) << ipc
+               << std::setw(14) << t.counts[CacheMisses] << std::setw(14) << t.counts[BranchMisses]
+               << std::setw(14) << std::setprecision(1) << perItemCycles
+               << std::setw(14) << std::setprecision(3) << perItemMisses << "\n";
+            os.unsetf(std::ios::fixed);
+            os << std::setprecision(6);
+        }
+    }
+};
+
+// RAII phase scope: one trace span plus, when enabled, a counter delta for the phase
+class PhaseScope {
+    TraceSpan span;
+    CyclePhase phase;
+    size_t items;
+    bool counting;
+    uint64_t begin[PerfCounters::NumCounters];
+public:
+    PhaseScope(CyclePhase p, size_t n)
+        : span(phaseName(p), "phase"), phase(p), items(n), counting(PerfCounters::instance().enabled()) {
+        if (counting) counting = PerfCounters::instance().read(begin);
+    }
+    ~PhaseScope() {
+        uint64_t end[PerfCounters::NumCounters];
+        if (counting && PerfCounters::instance().read(end))
+            PerfCounters::instance().accumulate(phase, begin, end, items);
+    }
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+};
+
+// -------------------------
+// FlightRecorder: Crash-surviving ring of compact cycle records in a mapped file
+// -------------------------
+// Records live in a MAP_SHARED file mapping, so the kernel keeps them even if
+// the process dies mid-cycle. Writing one is a 32-byte store plus a release of
+// the head counter.
+enum class FlightEvent : uint16_t { Cycle = 1, Trip, Reconnect, FaultInjected, FaultResolved, RemoteTrip, RemoteReset, SteadySkip, Response };
+
+struct FlightRecord {
+    uint32_t cycle;
+    uint16_t kind;     // FlightEvent
+    uint16_t reserved;
+    float a;           // Cycle: total power; others: component kW
+    float b;           // Cycle: total demand
+    char name[16];     // Component name, truncated, not necessarily terminated
+};
+static_assert(sizeof(FlightRecord) == 32, "FlightRecord must stay 32 bytes");
+
+class FlightRecorder {
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordSize;
+        uint64_t capacity;           // Power of two
+        std::atomic<uint64_t> head;  // Records written so far
+        char pad[32];
+    };
+    static_assert(sizeof(Header) == 64, "Header must stay 64 bytes");
+    static constexpr char kMagic[8] = {'S', 'G', 'S', 'F', 'L', 'T', 'R', '1'};
+
+    Header* header = nullptr;
+    FlightRecord* records = nullptr;
+    size_t mappedBytes = 0;
+    uint64_t mask = 0;
+
+    static const char* kindName(uint16_t kind) {
+        static const char* const names[] = {"?", "CYCLE", "TRIP", "RECONNECT", "FAULT", "RESOLVE", "REMOTE-TRIP", "REMOTE-RESET", "STEADY-SKIP", "RESPONSE"};
+        return kind < sizeof(names) / sizeof(names[0]) ? names[kind] : "?";
+    }
+
+public:
+    static FlightRecorder& instance() {
+        static FlightRecorder recorder;
+        return recorder;
+    }
+
+    ~FlightRecorder() {
+        if (header) munmap(header, mappedBytes);
+    }
+
+    bool active() const { return records != nullptr; }
+
+    // Creates (or truncates) the ring file with room for at least `events` records
+    bool open(const std::string& path, uint64_t events) {
+        uint64_t capacity = 1;
+        while (capacity < events) capacity <<= 1;
+        mappedBytes = sizeof(Header) + capacity * sizeof(FlightRecord);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        if (ftruncate(fd, static_cast<off_t>(mappedBytes)) != 0) { ::close(fd); return false; }
+        void* p = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        header = static_cast<Header*>(p);
+        std::memcpy(header->magic, kMagic, sizeof(kMagic));
+        header->version = 1;
+        header->recordSize = sizeof(FlightRecord);
+        header->capacity = capacity;
+        header->head.store(0, std::memory_order_relaxed);
+        records = reinterpret_cast<FlightRecord*>(header + 1);
+        mask = capacity - 1;
+        return true;
+    }
+
+    void record(FlightEvent kind, uint64_t cycle, float a, float b, const std::string& name) {
+        if (!records) return;
+        uint64_t h = header->head.load(std::memory_order_relaxed);
+        FlightRecord& r = records[h & mask];
+        r.cycle = static_cast<uint32_t>(cycle);
+        r.kind = static_cast<uint16_t>(kind);
+        r.reserved = 0;
+        r.a = a;
+        r.b = b;
+        size_t n = std::min(name.size(), sizeof(r.name));
+        std::memcpy(r.name, name.data(), n);
+        if (n < sizeof(r.name)) r.name[n] = '\0';
+        header->head.store(h + 1, std::memory_order_release);
+    }
+
+    // Offline dump tool: prints a recorder file oldest record first
+    static bool dump(const std::string& path, std::ostream& os) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) { ::close(fd); return false; }
+        size_t bytes = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        const Header* h = static_cast<const Header*>(p);
+        bool valid = std::memcmp(h->magic, kMagic, sizeof(kMagic)) == 0 && h->recordSize == sizeof(FlightRecord) &&
+                     h->capacity && bytes >= sizeof(Header) + h->capacity * sizeof(FlightRecord);
+        if (valid) {
+            const FlightRecord* recs = reinterpret_cast<const FlightRecord*>(h + 1);
+            uint64_t head = h->head.load(std::memory_order_acquire);
+            // When the ring has wrapped, the oldest slot may be mid-overwrite; skip it
+            uint64_t first = head > h->capacity ? head - h->capacity + 1 : 0;
+            os << "[Recorder] " << head - first << " of " << head << " records\n";
+            for (uint64_t i = first; i < head; ++i) {
+                const FlightRecord& r = recs[i & (h->capacity - 1)];
+                std::string name(r.name, strnlen(r.name, sizeof(r.name)));
+                os << "#" << i << " cycle " << r.cycle << " " << kindName(r.kind);
+                if (r.kind == static_cast<uint16_t>(FlightEvent::Cycle))
+                    os << " power=" << r.a << "kW demand=" << r.b << "kW";
+                else if (r.kind == static_cast<uint16_t>(FlightEvent::SteadySkip))
+                    os << " skipped=" << r.a;
+                else
+                    os << " " << name << " " << r.a << "kW";
+                os << "\n";
+            }
+        }
+        munmap(p, bytes);
+        return valid;
+    }
+};
+
+// -------------------------
+// NumaTopology: Memory nodes and the CPUs attached to each
+// -------------------------
+// Read once from /sys/devices/system/node. Machines without that directory
+// (or non-Linux hosts) are treated as a single node holding every CPU.
+class NumaTopology {
+    std::vector<std::vector<int>> nodeCpus;
+
+    // Parses a sysfs list such as "0-3,8-11"
+    static std::vector<int> parseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string part;
+        while (std::getline(ss, part, ',')) {
+            int first = 0, last = 0;
+            char dash = 0;
+            std::stringstream ps(part);
+            if (!(ps >> first)) continue;
+            last = (ps >> dash >> last) && dash == '-' ? last : first;
+            for (int c = first; c <= last; ++c)
+                cpus.push_back(c);
+        }
+        return cpus;
+    }
+
+    NumaTopology() {
+#ifdef __linux__
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string nodes;
+        std::getline(online, nodes);
+        for (int node : parseCpuList(nodes)) {  // Same list syntax as cpulist
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            std::getline(in, list);
+            std::vector<int> cpus = parseCpuList(list);
+            if (!cpus.empty()) nodeCpus.push_back(std::move(cpus));  // Memory-only nodes run no workers
+        }
+#endif
+        if (nodeCpus.empty()) {
+            nodeCpus.emplace_back();
+            for (unsigned int c = 0; c < std::max(1u, std::thread::hardware_concurrency()); ++c)
+                nodeCpus.back().push_back(static_cast<int>(c));
+        }
+    }
+
+public:
+    static const NumaTopology& instance() {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    size_t nodeCount() const { return nodeCpus.size(); }
+    const std::vector<int>& cpus(size_t node) const { return nodeCpus[node]; }
+};
+
+// -------------------------
+// ChunkArena: Huge-page backed memory for state column chunks
+// -------------------------
+// Chunks are carved from 64 MB regions aligned to 2 MB, so a full column scan
+// needs one TLB entry per 2 MB instead of one per 4 KB page. Regions come from
+// explicit huge pages (MAP_HUGETLB) or from anonymous memory advised for
+// transparent huge pages; when explicit pages run out the arena falls back to
+// transparent ones. Each NUMA node carves from its own region, so a chunk
+// rehomed by a worker still lands on that worker's node. Freed blocks are kept
+// on per-size free lists and regions are never unmapped.
+class ChunkArena {
+public:
+    enum class Mode { Off, Transparent, Explicit };
+
+    struct Usage {
+        size_t regions = 0;
+        size_t mappedBytes = 0;
+        size_t explicitPages = 0;     // 2 MB pages from the hugetlb pool
+        size_t transparentPages = 0;  // 2 MB pages the kernel backed via THP, per smaps
+    };
+
+private:
+    static constexpr size_t kHugePage = size_t(2) << 20;
+    static constexpr size_t kRegionSize = 32 * kHugePage;
+    static constexpr size_t kAlign = 64;
+    struct Region {
+        char* base;
+        size_t used;
+        bool explicitPages;
+    };
+
+    std::mutex m;
+    std::atomic<Mode> mode{Mode::Off};
+    std::atomic<bool> mapped{false};  // Lets deallocate() skip the lock before any region exists
+    std::vector<Region> regions;
+    std::vector<size_t> current;      // Per node: region being carved, or regions.size() if none
+    std::unordered_map<size_t, std::vector<void*>> freeLists;
+
+    ChunkArena() : current(NumaTopology::instance().nodeCount(), 0) {}
+
+    bool mapRegion() {
+#ifdef MAP_HUGETLB
+        if (mode.load() == Mode::Explicit) {
+            void* p = mmap(nullptr, kRegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                regions.push_back({static_cast<char*>(p), 0, true});
+                return true;
+            }
+        }
+#endif
+        // Over-map so the region can start on a 2 MB boundary, then trim the slack
+        size_t span = kRegionSize + kHugePage;
+        void* raw = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return false;
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned = (start + kHugePage - 1) & ~(kHugePage - 1);
+        if (aligned > start) munmap(raw, aligned - start);
+        if (aligned + kRegionSize < start + span) munmap(reinterpret_cast<void*>(aligned + kRegionSize), start + span - aligned - kRegionSize);
+#ifdef MADV_HUGEPAGE
+        madvise(reinterpret_cast<void*>(aligned), kRegionSize, MADV_HUGEPAGE);
+#endif
+        regions.push_back({reinterpret_cast<char*>(aligned), 0, false});
+        return true;
+    }
+
+public:
+    static ChunkArena& instance() {
+        static ChunkArena arena;
+        return arena;
+    }
+
+    // NUMA node of the calling thread; scheduler workers set their own
+    static size_t& threadNode() {
+        thread_local size_t node = 0;
+        return node;
+    }
+
+    // Affects later allocations only; blocks already handed out stay where they are
+    void setMode(Mode md) { mode = md; }
+    Mode getMode() const { return mode.load(); }
+
+    // nullptr when the arena is off or the block is too large; the caller then uses the heap
+    void* allocate(size_t bytes) {
+        if (mode.load(std::memory_order_relaxed) == Mode::Off) return nullptr;
+        bytes = (bytes + kAlign - 1) & ~(kAlign - 1);
+        if (bytes > kRegionSize) return nullptr;
+        std::lock_guard<std::mutex> lock(m);
+        auto fl = freeLists.find(bytes);
+        if (fl != freeLists.end() && !fl->second.empty()) {
+            void* p = fl->second.back();
+            fl->second.pop_back();
+            return p;
+        }
+        size_t& cur = current[threadNode() % current.size()];
+        if (cur >= regions.size() || regions[cur].used + bytes > kRegionSize) {
+            if (!mapRegion()) return nullptr;
+            cur = regions.size() - 1;
+            mapped = true;
+        }
+        void* p = regions[cur].base + regions[cur].used;
+        regions[cur].used += bytes;
+        return p;
+    }
+
+    // false if the block did not come from the arena
+    bool deallocate(void* p, size_t bytes) {
+        if (!mapped.load()) return false;
+        bytes = (bytes + kAlign - 1) & ~(kAlign - 1);
+        char* c = static_cast<char*>(p);
+        std::lock_guard<std::mutex> lock(m);
+        for (const Region& r : regions) {
+            if (c >= r.base && c < r.base + kRegionSize) {
+                freeLists[bytes].push_back(p);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Usage usage() {
+        Usage u;
+        std::vector<std::pair<uintptr_t, uintptr_t>> thp;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            u.regions = regions.size();
+            u.mappedBytes = regions.size() * kRegionSize;
+            for (const Region& r : regions) {
+                if (r.explicitPages) u.explicitPages += kRegionSize / kHugePage;
+                else thp.emplace_back(reinterpret_cast<uintptr_t>(r.base), reinterpret_cast<uintptr_t>(r.base) + kRegionSize);
+            }
+        }
+        // The kernel reports THP backing per mapping as "AnonHugePages: <n> kB"
+        std::ifstream smaps("/proc/self/smaps");
+        std::string line;
+        bool ours = false;
+        while (std::getline(smaps, line)) {
+            unsigned long long lo = 0, hi = 0;
+            if (std::sscanf(line.c_str(), "%llx-%llx ", &lo, &hi) == 2) {
+                ours = std::any_of(thp.begin(), thp.end(), [lo, hi](const std::pair<uintptr_t, uintptr_t>& r) {
+                    return lo < r.second && hi > r.first;
+                });
+            } else if (ours && line.compare(0, 14, "AnonHugePages:") == 0) {
+                u.transparentPages += std::strtoull(line.c_str() + 14, nullptr, 10) * 1024 / kHugePage;
+            }
+        }
+        return u;
+    }
+};
+
+// Routes allocate_shared through the arena, falling back to the heap
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    ArenaAllocator() {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        void* p = ChunkArena::instance().allocate(n * sizeof(T));
+        return static_cast<T*>(p ? p : ::operator new(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        if (!ChunkArena::instance().deallocate(p, n * sizeof(T))) ::operator delete(p);
+    }
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+// -------------------------
+// TaskScheduler: Work-stealing runtime shared by all parallel subsystems
+// -------------------------
+// Each worker owns a deque: it pushes and pops its own tasks at the back (hot in
+// cache) while idle workers steal from the front of others. A thread waiting on
+// a TaskGroup runs queued tasks instead of blocking. With zero workers the
+// scheduler runs everything inline on the calling thread, in submission order,
+// for deterministic debugging. Workers are spread round-robin over the NUMA
+// nodes and steal from workers on their own node before crossing to another.
+class TaskScheduler {
+public:
+    using Task = std::function<void()>;
+
+    class TaskGroup {
+        TaskScheduler& sched;
+        std::atomic<size_t> pending{0};
+    public:
+        explicit TaskGroup(TaskScheduler& s) : sched(s) {}
+        ~TaskGroup() { wait(); }
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        void run(Task t) { runOn(sched.workers.size(), std::move(t)); }
+
+        // Queues on a particular worker's deque; it runs there unless stolen
+        void runOn(size_t worker, Task t) {
+            if (sched.inlineMode()) { t(); return; }
+            pending.fetch_add(1, std::memory_order_relaxed);
+            sched.submit([this, t = std::move(t)]() {
+                t();
+                pending.fetch_sub(1, std::memory_order_release);
+            }, worker);
+        }
+
+        void wait() {
+            while (pending.load(std::memory_order_acquire))
+                if (!sched.runOne()) std::this_thread::yield();
+        }
+    };
+
+private:
+    struct Worker {
+        std::mutex m;
+        std::deque<Task> tasks;
+        std::thread thread;
+        size_t node = 0;
+        int cpu = 0;  // Pinning target, one of the node's CPUs
+    };
+    struct ThreadSlot {
+        const TaskScheduler* owner = nullptr;
+        size_t index = 0;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<bool> stopping{false};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> nextVictim{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+
+    static ThreadSlot& slot() {
+        thread_local ThreadSlot s;
+        return s;
+    }
+
+    size_t selfIndex() const {
+        const ThreadSlot& s = slot();
+        return s.owner == this ? s.index : workers.size();
+    }
+
+    bool take(size_t victim, bool own, Task& t) {
+        Worker& w = *workers[victim];
+        std::lock_guard<std::mutex> lock(w.m);
+        if (w.tasks.empty()) return false;
+        if (own) { t = std::move(w.tasks.back()); w.tasks.pop_back(); }
+        else { t = std::move(w.tasks.front()); w.tasks.pop_front(); }
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // target == workers.size() means the caller's own deque, or any deque from outside the pool
+    void submit(Task t, size_t target) {
+        size_t self = selfIndex();
+        if (target >= workers.size())
+            target = self < workers.size() ? self : nextVictim.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        {
+            std::lock_guard<std::mutex> lock(workers[target]->m);
+            workers[target]->tasks.push_back(std::move(t));
+        }
+        queued.fetch_add(1, std::memory_order_release);
+        { std::lock_guard<std::mutex> lock(sleepMutex); }  // Pairs with the sleeper's predicate check
+        wake.notify_one();
+    }
+
+    void workerLoop(size_t index, bool pin) {
+        slot() = {this, index};
+        ChunkArena::threadNode() = workers[index]->node;
+        Tracer::instance().setThreadName("worker-" + std::to_string(index));
+#ifdef __linux__
+        if (pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(workers[index]->cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+#else
+        (void)pin;
+#endif
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (runOne()) continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping.load() || queued.load() > 0; });
+        }
+    }
+
+public:
+    // workerThreads == 0 selects inline mode
+    explicit TaskScheduler(unsigned int workerThreads, bool pinThreads = false) {
+        const NumaTopology& topo = NumaTopology::instance();
+        for (unsigned int i = 0; i < workerThreads; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+            workers[i]->node = i % topo.nodeCount();
+            const std::vector<int>& cpus = topo.cpus(workers[i]->node);
+            workers[i]->cpu = cpus[(i / topo.nodeCount()) % cpus.size()];
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i]->thread = std::thread(&TaskScheduler::workerLoop, this, i, pinThreads);
+    }
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers)
+            w->thread.join();
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    bool inlineMode() const { return workers.empty(); }
+    size_t workerCount() const { return workers.size(); }
+    // Index of the calling worker, or workerCount() for threads outside the pool
+    size_t currentWorker() const { return selfIndex(); }
+    size_t workerNode(size_t worker) const { return workers[worker]->node; }
+    // A worker placed on `node`, or workerCount() if no worker runs there
+    size_t workerForNode(size_t node) const {
+        return node < workers.size() ? node : workers.size();  // Worker i lives on node i % nodes
+    }
+
+    // Runs one queued task (own deque first, then steal); false if none was found
+    bool runOne() {
+        if (workers.empty()) return false;
+        Task t;
+        size_t self = selfIndex();
+        bool found = self < workers.size() && take(self, true, t);
+        // Steal from workers on the thief's own node first, then from anyone
+        bool inPool = self < workers.size();
+        size_t home = inPool ? workers[self]->node : 0;
+        for (int pass = inPool ? 0 : 1; !found && pass < 2; ++pass) {
+            for (size_t k = 0; !found && k < workers.size(); ++k) {
+                size_t victim = (self + 1 + k) % workers.size();
+                if (victim != self && (pass == 1 || workers[victim]->node == home))
+                    found = take(victim, false, t);
+            }
+        }
+        if (!found) return false;
+        TraceSpan span("task", "worker");
+        t();
+        return true;
+    }
+
+    // Calls body(begin, end) over sub-ranges of at most `grain` items.
+    // Ranges are split recursively, so stolen work is always the largest piece left.
+    void parallelFor(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& body) {
+        if (end <= begin) return;
+        grain = std::max<size_t>(1, grain);
+        if (inlineMode() || end - begin <= grain) {
+            body(begin, end);
+            return;
+        }
+        TaskGroup group(*this);
+        splitRange(group, begin, end, grain, body);
+        group.wait();
+    }
+
+private:
+    void splitRange(TaskGroup& group, size_t begin, size_t end, size_t grain,
+                    const std::function<void(size_t, size_t)>& body) {
+        while (end - begin > grain) {
+            size_t mid = begin + (end - begin) / 2;
+            group.run([this, &group, mid, end, grain, &body]() { splitRange(group, mid, end, grain, body); });
+            end = mid;
+        }
+        body(begin, end);
+    }
+};
+
+// -------------------------
+// GridSnapshot: Read-only view of the grid published after each change
+// -------------------------
+struct GridSnapshot {
+    struct Entry {
+        std::string name;
+        bool isSource;
+        bool tripped;
+        bool connected;
+        float rating;    // Nameplate output (sources) or demand (loads) in kW
+        float flow;      // Power actually generated or drawn this cycle in kW
+        int priority;    // Shedding priority (0 for sources)
+    };
+    std::vector<Entry> components;  // Sources first, then loads, in insertion order
+    bool topologyChanged = true;    // Names or count differ from the previous snapshot published
+};
+
+// -------------------------
+// GridObserver Interface: Receives snapshots without touching the simulation
+// -------------------------
+class GridObserver {
+public:
+    virtual ~GridObserver() {}
+    virtual void onGridUpdate(const GridSnapshot& snapshot) = 0;
+};
+
+// -------------------------
+// GridTransaction: Staged mutations applied atomically by GridManager::commit
+// -------------------------
+// Actions are recorded in order and validated as a whole before any of them
+// touches the grid; the grid then balances once instead of once per action.
+class GridTransaction {
+    friend class GridManager;
+    enum class Kind { AddLoad, AddSource, Disconnect, Reconnect, SetDemand, Trip, Reset, Fault, Resolve };
+    struct Action {
+        Kind kind;
+        std::string name;
+        float value;
+        int priority;
+        PowerComponent* source;  // Owned until committed
+    };
+    std::vector<Action> actions;
+
+    GridTransaction& stage(Kind k, const std::string& name, float value = 0, int priority = 0, PowerComponent* src = nullptr) {
+        actions.push_back({k, name, value, priority, src});
+        return *this;
+    }
+
+public:
+    GridTransaction() {}
+    GridTransaction(const GridTransaction&) = delete;
+    GridTransaction& operator=(const GridTransaction&) = delete;
+    ~GridTransaction() {
+        for (auto& a : actions)
+            delete a.source;  // Sources that were never committed
+    }
+
+    GridTransaction& addLoad(const Load& l) { return stage(Kind::AddLoad, l.getName(), l.getRawDemand(), l.getPriority()); }
+    GridTransaction& addSource(PowerComponent* src) { return stage(Kind::AddSource, src->getName(), 0, 0, src); }
+    GridTransaction& disconnectLoad(const std::string& name) { return stage(Kind::Disconnect, name); }
+    GridTransaction& reconnectLoad(const std::string& name) { return stage(Kind::Reconnect, name); }
+    GridTransaction& setLoadDemand(const std::string& name, float kW) { return stage(Kind::SetDemand, name, kW); }
+    GridTransaction& tripBreaker(const std::string& name) { return stage(Kind::Trip, name); }
+    GridTransaction& resetBreaker(const std::string& name) { return stage(Kind::Reset, name); }
+    GridTransaction& injectFault(const std::string& name) { return stage(Kind::Fault, name); }
+    GridTransaction& resolveFault(const std::string& name) { return stage(Kind::Resolve, name); }
+    size_t size() const { return actions.size(); }
+    bool empty() const { return actions.empty(); }
+};
+
+// -------------------------
+// CowColumn: Chunked column shared copy-on-write between grid states
+// -------------------------
+// Copying a column copies one pointer. The first write after a copy clones the
+// chunk table (one pointer per chunk) and then only the chunk being written, so
+// a branch pays for the chunks it modifies rather than for the whole grid.
+// Chunks are allocated through ChunkArena, so --huge-pages covers every column.
+template <typename T>
+class CowColumn {
+public:
+    static constexpr size_t kChunkBits = 10;
+    static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+
+private:
+    using Chunk = std::vector<T, ArenaAllocator<T>>;  // Grows to kChunkSize, so small grids stay small
+    using Table = std::vector<std::shared_ptr<Chunk>>;
+    std::shared_ptr<Table> table = std::make_shared<Table>();
+    size_t count = 0;
+
+    Table& ownTable() {
+        if (table.use_count() > 1) table = std::make_shared<Table>(*table);
+        return *table;
+    }
+
+public:
+    size_t size() const { return count; }
+    size_t chunks() const { return table->size(); }
+    const T* chunk(size_t c) const { return (*table)[c]->data(); }
+    size_t chunkLength(size_t c) const { return std::min(kChunkSize, count - (c << kChunkBits)); }
+
+    const T& operator[](size_t i) const { return (*(*table)[i >> kChunkBits])[i & (kChunkSize - 1)]; }
+
+    T& mut(size_t i) {
+        std::shared_ptr<Chunk>& c = ownTable()[i >> kChunkBits];
+        if (c.use_count() > 1) c = std::allocate_shared<Chunk>(ArenaAllocator<Chunk>(), *c);
+        return (*c)[i & (kChunkSize - 1)];
+    }
+
+    // Replaces chunk c with a private copy written by the calling thread, so
+    // first-touch allocation puts it on that thread's NUMA node. Call detach()
+    // first; different chunks may then be rehomed concurrently.
+    void detach() { ownTable(); }
+    void rehome(size_t c) {
+        std::shared_ptr<Chunk>& p = (*table)[c];
+        p = std::allocate_shared<Chunk>(ArenaAllocator<Chunk>(), *p);
+    }
+
+    void push_back(const T& v) {
+        if ((count & (kChunkSize - 1)) == 0) ownTable().push_back(std::allocate_shared<Chunk>(ArenaAllocator<Chunk>()));
+        std::shared_ptr<Chunk>& c = ownTable().back();
+        if (c.use_count() > 1) c = std::allocate_shared<Chunk>(ArenaAllocator<Chunk>(), *c);
+        c->push_back(v);
+        ++count;
+    }
+};
+
+// -------------------------
+// NameIndex: Component name lookup shared between grid states
+// -------------------------
+// While a state is unshared, names go straight into the base map. After a fork,
+// new names go into a small private delta that is folded into a fresh base once
+// it grows large, so forking never copies the index.
+class NameIndex {
+public:
+    struct Ref {
+        bool isSource;
+        uint32_t index;
+    };
+
+private:
+    using Map = std::unordered_map<std::string, Ref>;
+    static constexpr size_t kMaxDelta = 4096;
+    std::shared_ptr<Map> base = std::make_shared<Map>();
+    std::shared_ptr<Map> delta = std::make_shared<Map>();
+
+public:
+    const Ref* find(const std::string& name) const {
+        if (!delta->empty()) {
+            auto it = delta->find(name);
+            if (it != delta->end()) return &it->second;
+        }
+        auto it = base->find(name);
+        return it == base->end() ? nullptr : &it->second;
+    }
+
+    // First registration of a name wins, as with the original breaker map
+    void insert(const std::string& name, Ref ref) {
+        if (find(name)) return;
+        if (base.use_count() == 1 && delta->empty()) {
+            base->emplace(name, ref);
+            return;
+        }
+        if (delta.use_count() > 1) delta = std::make_shared<Map>(*delta);
+        delta->emplace(name, ref);
+        if (delta->size() > kMaxDelta) {
+            if (base.use_count() > 1) base = std::make_shared<Map>(*base);
+            base->insert(delta->begin(), delta->end());
+            delta = std::make_shared<Map>();
+        }
+    }
+};
+
+// -------------------------
+// CycleStats: Outcome of the latest simulation cycle
+// -------------------------
+struct CycleStats {
+    float power = 0;          // Generation
+    float requested = 0;      // Demand of every load, including shed and disconnected ones
+    float demand = 0;         // Demand after balancing
+    float imported = 0;       // Net tie-line import (negative when exporting)
+    uint32_t trips = 0;
+    uint32_t reconnects = 0;
+    int minTripPriority = -1;  // Most important priority shed this cycle, -1 if none
+    float responded = 0;       // Demand relieved by demand response instead of shedding
+    float repaid = 0;          // Deferred demand served again
+};
+
+// -------------------------
+// GridState: Everything a simulation cycle reads or writes, cheap to fork
+// -------------------------
+// Loads are stored as columns. Each breaker is the tripped flag of its component.
+struct GridState {
+    static constexpr uint32_t kNoNode = UINT32_MAX;
+    static constexpr uint32_t kNotEnrolled = UINT32_MAX;
+
+    CowColumn<std::shared_ptr<PowerComponent>> sources;  // Cloned on first write when shared
+    CowColumn<uint8_t> sourceTripped;
+    CowColumn<uint32_t> sourceNode;  // Topology node the source feeds, kNoNode if unattached
+    CowColumn<std::string> loadNames;
+    CowColumn<float> loadDemand;
+    CowColumn<int> loadPriority;
+    CowColumn<uint8_t> loadConnected;
+    CowColumn<uint8_t> loadTripped;
+    CowColumn<uint32_t> loadNode;
+    CowColumn<uint32_t> loadEnrolment;  // Demand response enrolment, kNotEnrolled if none
+    NameIndex index;
+    // Topology: substations, feeders and transformers by depth. A parent is
+    // always added before its children, so parents have the lower index.
+    CowColumn<std::string> nodeNames;
+    CowColumn<uint32_t> nodeParent;  // kNoNode for a substation
+    CowColumn<float> nodeRating;     // kW the subtree may draw, 0 if unrated
+    NameIndex nodeIndex;             // Ref::isSource is unused
+    // Load classes: many identical loads held as counts per state. Instance k
+    // of class C is named "C:k" once it is materialized as an ordinary load.
+    CowColumn<std::string> classNames;
+    CowColumn<float> classDemand;  // Per instance
+    CowColumn<int> classPriority;
+    CowColumn<uint32_t> classSize;  // Instances the class was created with
+    CowColumn<uint32_t> classOnline, classIdle, classTripped;
+    NameIndex classIndex;  // Ref::isSource is unused
+    // Demand response enrolments. A curtailable load offers drShare of its
+    // demand and that energy is lost; a shiftable load offers all of it and
+    // takes it back later, within drWindow cycles of first deferring. Either
+    // stops offering once drUsed reaches drBudget.
+    CowColumn<uint32_t> drLoad;
+    CowColumn<float> drShare;      // Fraction of demand offered; 1 when shifting
+    CowColumn<float> drPrice;      // Per kW relieved for a cycle
+    CowColumn<float> drBudget;     // kW-cycles that may go unserved, or be owed at once when shifting
+    CowColumn<float> drUsed;       // Curtailed so far, or currently owed when shifting
+    CowColumn<uint32_t> drWindow;  // 0 for a curtailable load
+    CowColumn<uint64_t> drOwedSince;  // Cycle a shiftable load began to owe, 0 if it owes nothing
+    std::shared_ptr<const std::set<std::string>> faults = std::make_shared<const std::set<std::string>>();
+    uint64_t cycle = 0;
+    CycleStats last;
+};
+
+// -------------------------
+// AggregationTree: Cached subtree totals over the grid topology
+// -------------------------
+// Each node caches the demand, generation and shed count of its subtree. A
+// change to a load or source marks the path from its node to the root dirty,
+// stopping at the first node that already is, so every dirty node has dirty
+// ancestors. A query re-sums only dirty nodes, each from its children's cached
+// totals and its own direct attachments, so after a local change it costs
+// O(depth x fanout) instead of a scan of the grid. The cache is derived from a
+// GridState and rebuilt from it after the topology or the state changes.
+class AggregationTree {
+public:
+    struct Totals {
+        float demand = 0;      // Connected, untripped loads
+        float generation = 0;  // Live sources as of the last cycle
+        uint32_t shed = 0;     // Tripped loads
+        uint32_t loads = 0;
+    };
+
+private:
+    std::vector<uint32_t> parent;
+    std::vector<std::vector<uint32_t>> children, loadsAt, sourcesAt;
+    std::vector<uint32_t> rated;  // Nodes with a rating, parents first
+    std::vector<Totals> totals;
+    std::vector<uint8_t> dirty;
+    bool built = false;
+
+public:
+    bool isBuilt() const { return built; }
+    void invalidate() { built = false; }
+    const std::vector<uint32_t>& ratedNodes() const { return rated; }
+    const std::vector<uint32_t>& childrenOf(uint32_t node) const { return children[node]; }
+
+    void rebuild(const GridState& st) {
+        const size_t n = st.nodeParent.size();
+        parent.resize(n);
+        children.assign(n, {});
+        loadsAt.assign(n, {});
+        sourcesAt.assign(n, {});
+        rated.clear();
+        for (size_t i = 0; i < n; ++i) {
+            parent[i] = st.nodeParent[i];
+            if (parent[i] != GridState::kNoNode) children[parent[i]].push_back(static_cast<uint32_t>(i));
+            if (st.nodeRating[i] > 0) rated.push_back(static_cast<uint32_t>(i));
+        }
+        if (n) {
+            for (size_t i = 0; i < st.loadNode.size(); ++i)
+                if (st.loadNode[i] != GridState::kNoNode) loadsAt[st.loadNode[i]].push_back(static_cast<uint32_t>(i));
+            for (size_t i = 0; i < st.sourceNode.size(); ++i)
+                if (st.sourceNode[i] != GridState::kNoNode) sourcesAt[st.sourceNode[i]].push_back(static_cast<uint32_t>(i));
+        }
+        totals.assign(n, Totals());
+        dirty.assign(n, 1);
+        built = true;
+    }
+
+    // O(depth), and O(1) once the path is already dirty
+    void touch(uint32_t node) {
+        while (node != GridState::kNoNode && !dirty[node]) {
+            dirty[node] = 1;
+            node = parent[node];
+        }
+    }
+
+    // `generation` holds each source's output from the last cycle
+    const Totals& query(uint32_t node, const GridState& st, const std::vector<float>& generation) {
+        if (!dirty[node]) return totals[node];
+        Totals t;
+        for (uint32_t c : children[node]) {
+            const Totals& sub = query(c, st, generation);
+            t.demand += sub.demand;
+            t.generation += sub.generation;
+            t.shed += sub.shed;
+            t.loads += sub.loads;
+        }
+        for (uint32_t i : loadsAt[node]) {
+            ++t.loads;
+            if (st.loadTripped[i]) ++t.shed;
+            else if (st.loadConnected[i]) t.demand += st.loadDemand[i];
+        }
+        for (uint32_t i : sourcesAt[node])
+            if (i < generation.size()) t.generation += generation[i];
+        totals[node] = t;
+        dirty[node] = 0;
+        return totals[node];
+    }
+
+    // Every load in the subtree, in depth-first order
+    void loadsUnder(uint32_t node, std::vector<uint32_t>& out) const {
+        out.insert(out.end(), loadsAt[node].begin(), loadsAt[node].end());
+        for (uint32_t c : children[node])
+            loadsUnder(c, out);
+    }
+};
+
+// -------------------------
+// DemandForecast: Holt exponential smoothing of demand and solar output
+// -------------------------
+// Holt's method keeps a level and a trend per series. The trend is damped by
+// kDamping per cycle, so a k-cycle forecast levels off instead of running away
+// on noisy series such as solar output over a planning window. Per-load series are updated in
+// branch-free blocks of 16 lanes, which compilers vectorize even at -O2. The
+// method is linear, so the grid total and each topology node are smoothed as
+// series of their own: that equals summing the per-load states, up to
+// rounding, at O(1) per series instead of a reduction over every load.
+class DemandForecast {
+public:
+    static constexpr float kDamping = 0.9f;
+
+    // Sum of kDamping^1..k: how much of today's trend a k-cycle forecast carries
+    static float trendWeight(uint32_t k) {
+        return kDamping * (1 - std::pow(kDamping, static_cast<float>(k))) / (1 - kDamping);
+    }
+
+    struct Series {
+        float level = 0, trend = 0;
+        bool primed = false;
+        void observe(float x, float alpha, float beta) {
+            if (!primed) {
+                level = x;
+                primed = true;
+                return;
+            }
+            const float prev = level;
+            level = alpha * x + (1 - alpha) * (prev + kDamping * trend);
+            trend = beta * (level - prev) + (1 - beta) * kDamping * trend;
+        }
+        float ahead(uint32_t k) const { return std::max(0.0f, level + trendWeight(k) * trend); }
+    };
+
+private:
+    static constexpr size_t kLanes = 16;
+    float alpha, beta;
+    std::vector<float> level, trend;  // Per load, indexed like the load columns
+    Series demand, solar;
+    std::vector<Series> nodes;
+
+    // What a load draws before balancing is its demand if connected and
+    // untripped. Called with n == kLanes the loop has a fixed trip count and
+    // no aliasing, which is what the vectorizer needs.
+    static void observeLanes(const float* __restrict x, const uint8_t* __restrict connected,
+                             const uint8_t* __restrict tripped, float* __restrict lvl, float* __restrict trd,
+                             size_t n, float a, float b) {
+        for (size_t j = 0; j < n; ++j) {
+            const float v = x[j] * static_cast<float>(connected[j] & (tripped[j] ^ 1));
+            const float prev = lvl[j];
+            const float next = a * v + (1 - a) * (prev + kDamping * trd[j]);
+            trd[j] = b * (next - prev) + (1 - b) * kDamping * trd[j];
+            lvl[j] = next;
+        }
+    }
+
+public:
+    DemandForecast(float alpha, float beta) : alpha(alpha), beta(beta) {}
+
+    void observeLoads(const GridState& st) {
+        const size_t n = st.loadDemand.size();
+        // A new load starts at its current draw with no trend
+        for (size_t i = level.size(); i < n; ++i) {
+            level.push_back(st.loadConnected[i] && !st.loadTripped[i] ? st.loadDemand[i] : 0.0f);
+            trend.push_back(0.0f);
+        }
+        for (size_t c = 0; c < st.loadDemand.chunks(); ++c) {
+            const size_t base = c << CowColumn<float>::kChunkBits;
+            const float* x = st.loadDemand.chunk(c);
+            const uint8_t* connected = st.loadConnected.chunk(c);
+            const uint8_t* tripped = st.loadTripped.chunk(c);
+            float* lvl = level.data() + base;
+            float* trd = trend.data() + base;
+            const size_t n = st.loadDemand.chunkLength(c);
+            size_t j = 0;
+            for (; j + kLanes <= n; j += kLanes)
+                observeLanes(x + j, connected + j, tripped + j, lvl + j, trd + j, kLanes, alpha, beta);
+            observeLanes(x + j, connected + j, tripped + j, lvl + j, trd + j, n - j, alpha, beta);
+        }
+    }
+    void observeTotals(float demandKW, float solarKW) {
+        demand.observe(demandKW, alpha, beta);
+        solar.observe(solarKW, alpha, beta);
+    }
+    void observeNode(size_t node, float demandKW) {
+        if (node >= nodes.size()) nodes.resize(node + 1);
+        nodes[node].observe(demandKW, alpha, beta);
+    }
+
+    float demandAhead(uint32_t k) const { return demand.ahead(k); }
+    float solarAhead(uint32_t k) const { return solar.ahead(k); }
+    float loadAhead(size_t i, uint32_t k) const {
+        return i < level.size() ? std::max(0.0f, level[i] + trendWeight(k) * trend[i]) : 0.0f;
+    }
+    float nodeAhead(size_t node, uint32_t k) const { return node < nodes.size() ? nodes[node].ahead(k) : 0.0f; }
+};
+
+// -------------------------
+// BidCurve: Demand response offers in price order
+// -------------------------
+// Enrolments are sorted by price once, after enrolments are added, and the kW
+// each offers is kept in a binary indexed tree along that order. Covering a
+// deficit is a descent of the tree to the last offer needed, so a call costs
+// O(k log n) for the k loads it touches, however many are enrolled. Like the
+// aggregation tree the curve is derived from a GridState: offers whose load or
+// enrolment changed are queued and re-read before the next call, and the whole
+// curve is rebuilt after the state is swapped.
+class BidCurve {
+    std::vector<uint32_t> order;   // Enrolments by price, ties in enrolment order
+    std::vector<uint32_t> rank;    // Position of each enrolment in order
+    std::vector<float> offered;    // kW at each position as last read
+    std::vector<double> fenwick;   // 1-based partial sums of offered
+    std::vector<uint32_t> stale;   // Enrolments whose offer may have changed since
+    std::vector<uint32_t> owing;   // Shiftable enrolments with deferred demand, oldest first
+    bool sorted = false, summed = false;
+
+    void add(size_t pos, double kW) {
+        for (size_t j = pos + 1; j < fenwick.size(); j += j & (~j + 1))
+            fenwick[j] += kW;
+    }
+
+    void sort(const GridState& st) {
+        const uint32_t n = static_cast<uint32_t>(st.drLoad.size());
+        order.resize(n);
+        for (uint32_t e = 0; e < n; ++e)
+            order[e] = e;
+        const auto& price = st.drPrice;
+        std::stable_sort(order.begin(), order.end(), [&price](uint32_t a, uint32_t b) { return price[a] < price[b]; });
+        rank.resize(n);
+        for (uint32_t j = 0; j < n; ++j)
+            rank[order[j]] = j;
+        owing.clear();
+        for (uint32_t e = 0; e < n; ++e)
+            if (st.drWindow[e] && st.drUsed[e] > 0) owing.push_back(e);
+        const auto& since = st.drOwedSince;
+        std::stable_sort(owing.begin(), owing.end(), [&since](uint32_t a, uint32_t b) { return since[a] < since[b]; });
+        sorted = true;
+        summed = false;
+    }
+
+    // A shiftable load whose window has run out must take back what it owes
+    // before it defers any more
+    static float offerOf(const GridState& st, uint32_t i, float share, float budget, float used, uint32_t window,
+                         uint64_t since) {
+        if (!st.loadConnected[i] || st.loadTripped[i]) return 0;
+        if (window && since && st.cycle - since >= window) return 0;
+        return std::max(0.0f, std::min(share * st.loadDemand[i], budget - used));
+    }
+
+public:
+    // kW enrolment e can relieve this cycle
+    static float offer(const GridState& st, uint32_t e) {
+        return offerOf(st, st.drLoad[e], st.drShare[e], st.drBudget[e], st.drUsed[e], st.drWindow[e], st.drOwedSince[e]);
+    }
+
+    void invalidate() {
+        sorted = summed = false;
+        stale.clear();
+    }
+    // Each update walks the tree at random, so past about a thirty-second of
+    // the curve one sequential pass is cheaper
+    void touch(uint32_t e) {
+        if (!summed) return;
+        if (stale.size() > order.size() / 32 + 64) {
+            summed = false;
+            stale.clear();
+        } else {
+            stale.push_back(e);
+        }
+    }
+    std::vector<uint32_t>& debtors(const GridState& st) {
+        if (!sorted) sort(st);
+        return owing;
+    }
+
+    // Brings every offer up to date with the state
+    void refresh(const GridState& st) {
+        if (!sorted) sort(st);
+        const size_t n = order.size();
+        if (!summed) {
+            // Read a chunk at a time in enrolment order, which follows the
+            // load columns, and scatter into price order
+            offered.resize(n);
+            for (size_t c = 0; c < st.drLoad.chunks(); ++c) {
+                const size_t base = c << CowColumn<uint32_t>::kChunkBits, len = st.drLoad.chunkLength(c);
+                const uint32_t* load = st.drLoad.chunk(c);
+                const float* share = st.drShare.chunk(c);
+                const float* budget = st.drBudget.chunk(c);
+                const float* used = st.drUsed.chunk(c);
+                const uint32_t* window = st.drWindow.chunk(c);
+                const uint64_t* since = st.drOwedSince.chunk(c);
+                for (size_t j = 0; j < len; ++j)
+                    offered[rank[base + j]] = offerOf(st, load[j], share[j], budget[j], used[j], window[j], since[j]);
+            }
+            fenwick.assign(n + 1, 0.0);
+            for (size_t j = 0; j < n; ++j) {
+                fenwick[j + 1] += offered[j];
+                const size_t up = (j + 1) + ((j + 1) & (~(j + 1) + 1));
+                if (up <= n) fenwick[up] += fenwick[j + 1];
+            }
+            summed = true;
+            stale.clear();
+            return;
+        }
+        // Windows run out with the cycle count, not with a write
+        for (uint32_t e : owing)
+            if (st.cycle - st.drOwedSince[e] >= st.drWindow[e]) stale.push_back(e);
+        for (uint32_t e : stale) {
+            const uint32_t pos = rank[e];
+            const float kW = offer(st, e);
+            if (kW == offered[pos]) continue;
+            add(pos, static_cast<double>(kW) - offered[pos]);
+            offered[pos] = kW;
+        }
+        stale.clear();
+    }
+
+    // Number of leading offers that together reach kW, or all of them
+    size_t cover(double kW) const {
+        const size_t n = order.size();
+        size_t pos = 0, step = 1;
+        while (step * 2 <= n)
+            step *= 2;
+        for (; step; step >>= 1) {
+            if (pos + step <= n && fenwick[pos + step] < kW) {
+                pos += step;
+                kW -= fenwick[pos];
+            }
+        }
+        return std::min(pos + 1, n);
+    }
+    uint32_t at(size_t pos) const { return order[pos]; }
+    float offeredAt(size_t pos) const { return offered[pos]; }
+};
+
+// -------------------------
+// LinearProgram: Dense two-phase simplex for small dispatch problems
+// -------------------------
+// Minimizes cost.x subject to rows of <=, == or >= constraints and x >= 0.
+// The tableau is dense, which suits the few hundred variables of a dispatch
+// horizon. Pricing is Dantzig's rule, switching to Bland's after a run of
+// degenerate pivots so the method cannot cycle. solve() gives up at a
+// deadline and leaves the caller to fall back to a cheaper policy.
+class LinearProgram {
+public:
+    enum Sense : uint8_t { Le, Eq, Ge };
+    enum class Result { Optimal, Infeasible, Unbounded, OutOfTime };
+    using Terms = std::vector<std::pair<uint32_t, double>>;
+
+private:
+    static constexpr double kEps = 1e-9;
+    struct Row {
+        Terms terms;
+        Sense sense;
+        double rhs;
+    };
+    std::vector<double> cost;
+    std::vector<Row> rows;
+    std::vector<double> tab;  // (rows + 2 objectives) x width, row-major
+    std::vector<uint32_t> basis;
+    size_t width = 0;
+
+    double& at(size_t r, size_t c) { return tab[r * width + c]; }
+
+    void pivot(size_t pr, size_t pc, size_t tableRows) {
+        const double inv = 1.0 / at(pr, pc);
+        for (size_t c = 0; c < width; ++c)
+            at(pr, c) *= inv;
+        for (size_t r = 0; r < tableRows; ++r) {
+            const double f = at(r, pc);
+            if (r == pr || f == 0) continue;
+            for (size_t c = 0; c < width; ++c)
+                at(r, c) -= f * at(pr, c);
+        }
+        basis[pr] = static_cast<uint32_t>(pc);
+    }
+
+    // Runs the simplex on objective row `obj`, entering only columns below `cols`
+    Result iterate(size_t obj, size_t cols, std::chrono::steady_clock::time_point deadline) {
+        const size_t m = rows.size(), rhs = width - 1;
+        uint32_t degenerate = 0;
+        for (uint64_t it = 0;; ++it) {
+            if ((it & 7) == 0 && std::chrono::steady_clock::now() > deadline) return Result::OutOfTime;
+            const bool bland = degenerate > 32;
+            size_t pc = cols;
+            double best = -kEps;
+            for (size_t c = 0; c < cols; ++c) {
+                if (at(obj, c) < best) {
+                    pc = c;
+                    if (bland) break;
+                    best = at(obj, c);
+                }
+            }
+            if (pc == cols) return Result::Optimal;
+            size_t pr = m;
+            double ratio = 0;
+            for (size_t r = 0; r < m; ++r) {
+                if (at(r, pc) <= kEps) continue;
+                const double q = at(r, rhs) / at(r, pc);
+                if (pr == m || q < ratio - kEps || (q <= ratio + kEps && basis[r] < basis[pr])) {
+                    pr = r;
+                    ratio = q;
+                }
+            }
+            if (pr == m) return Result::Unbounded;
+            degenerate = ratio <= kEps ? degenerate + 1 : 0;
+            pivot(pr, pc, m + 2);
+        }
+    }
+
+public:
+    void clear() {
+        cost.clear();
+        rows.clear();
+    }
+    uint32_t addVariable(double c) {
+        cost.push_back(c);
+        return static_cast<uint32_t>(cost.size() - 1);
+    }
+    size_t variables() const { return cost.size(); }
+    void addRow(Terms terms, Sense sense, double rhs) { rows.push_back({std::move(terms), sense, rhs}); }
+
+    Result solve(std::chrono::steady_clock::time_point deadline, std::vector<double>& x) {
+        const size_t n = cost.size(), m = rows.size();
+        // Columns: structural, one slack or surplus per inequality, one artificial per ==/>= row, rhs
+        size_t slacks = 0, artificials = 0;
+        for (auto& r : rows) {
+            if (r.rhs < 0) {
+                r.rhs = -r.rhs;
+                for (auto& t : r.terms)
+                    t.second = -t.second;
+                r.sense = r.sense == Le ? Ge : r.sense == Ge ? Le : Eq;
+            }
+            slacks += r.sense != Eq;
+            artificials += r.sense != Le;
+        }
+        const size_t artStart = n + slacks;
+        width = artStart + artificials + 1;
+        tab.assign((m + 2) * width, 0.0);
+        basis.assign(m, 0);
+        const size_t p1 = m, p2 = m + 1, rhs = width - 1;
+        size_t slack = n, art = artStart;
+        for (size_t i = 0; i < m; ++i) {
+            const Row& r = rows[i];
+            for (const auto& t : r.terms)
+                at(i, t.first) += t.second;
+            at(i, rhs) = r.rhs;
+            if (r.sense == Le) {
+                at(i, slack) = 1;
+                basis[i] = static_cast<uint32_t>(slack++);
+                continue;
+            }
+            if (r.sense == Ge) at(i, slack++) = -1;
+            at(i, art) = 1;
+            basis[i] = static_cast<uint32_t>(art++);
+            // Phase 1 minimizes the artificials: price them out of the objective
+            for (size_t c = 0; c < artStart; ++c)
+                at(p1, c) -= at(i, c);
+            at(p1, rhs) -= r.rhs;
+        }
+        for (size_t c = 0; c < n; ++c)
+            at(p2, c) = cost[c];
+
+        Result res = iterate(p1, artStart, deadline);
+        if (res == Result::OutOfTime) return res;
+        if (-at(p1, rhs) > 1e-6) return Result::Infeasible;
+        // Artificials left basic at zero are swapped for any real column; a row with none is redundant
+        for (size_t i = 0; i < m; ++i) {
+            if (basis[i] < artStart) continue;
+            for (size_t c = 0; c < artStart; ++c) {
+                if (std::fabs(at(i, c)) > kEps) {
+                    pivot(i, c, m + 2);
+                    break;
+                }
+            }
+        }
+        res = iterate(p2, artStart, deadline);
+        if (res != Result::Optimal) return res;
+        x.assign(n, 0.0);
+        for (size_t i = 0; i < m; ++i)
+            if (basis[i] < n) x[basis[i]] = at(i, rhs);
+        return res;
+    }
+};
+
+// -------------------------
+// Behavior: Component behaviors as coroutines on simulated time (C++20 builds)
+// -------------------------
+// A behavior co_awaits sleepCycles(n) and is resumed by its grid's
+// BehaviorKernel at the start of the cycle n cycles later, before remote
+// commands are applied. The kernel keeps wakes within 256 cycles on a timing
+// wheel and later ones in a min-heap, so behaviors due in the same cycle resume
+// in a fixed order and a resume costs O(1) in the common case. Frames come from
+// a pool of 64-byte size classes owned by the grid's kernel, so millions of
+// suspended behaviors cost one small block each and no heap traffic per spawn.
+// A grid is only ever stepped by one thread at a time, but not always the
+// same one, so the pool is per grid rather than per thread.
+#ifdef SMARTGRID_COROUTINES
+class FramePool {
+    static constexpr size_t kGranule = 64;
+    static constexpr size_t kClasses = 16;  // Frames up to 1 KB; larger ones use the heap
+    static constexpr size_t kSlab = 64 * 1024;
+    struct FreeBlock { FreeBlock* next; };
+    FreeBlock* heads[kClasses] = {};
+    std::vector<std::unique_ptr<char[]>> slabs;
+    char* bump = nullptr;
+    size_t left = 0;
+
+public:
+    static constexpr size_t kHeader = alignof(std::max_align_t);  // Room for the owning pool before a frame
+
+    FramePool() {}
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    void* allocate(size_t n) {
+        size_t c = (n + kGranule - 1) / kGranule;
+        if (c == 0 || c > kClasses) return ::operator new(n);
+        if (FreeBlock* f = heads[c - 1]) {
+            heads[c - 1] = f->next;
+            return f;
+        }
+        size_t bytes = c * kGranule;
+        if (left < bytes) {
+            slabs.emplace_back(new char[kSlab]);
+            bump = slabs.back().get();
+            left = kSlab;
+        }
+        void* p = bump;
+        bump += bytes;
+        left -= bytes;
+        return p;
+    }
+
+    void deallocate(void* p, size_t n) {
+        size_t c = (n + kGranule - 1) / kGranule;
+        if (c == 0 || c > kClasses) { ::operator delete(p); return; }
+        FreeBlock* f = static_cast<FreeBlock*>(p);
+        f->next = heads[c - 1];
+        heads[c - 1] = f;
+    }
+};
+
+class BehaviorKernel;
+
+class Behavior {
+public:
+    struct promise_type {
+        BehaviorKernel* kernel = nullptr;
+        Behavior get_return_object() { return Behavior(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }  // Started by the kernel
+        std::suspend_always final_suspend() noexcept { return {}; }    // Destroyed by the kernel
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        // A frame is allocated before its behavior is spawned, so the pool is
+        // found through the grid passed as the first parameter. The block
+        // records its pool, so it goes back there whichever thread frees it.
+        template <class Grid, class... Args>
+        static void* operator new(size_t n, Grid& grid, Args&...) {
+            FramePool& pool = grid.framePool();
+            char* block = static_cast<char*>(pool.allocate(n + FramePool::kHeader));
+            *reinterpret_cast<FramePool**>(block) = &pool;
+            return block + FramePool::kHeader;
+        }
+        static void operator delete(void* p, size_t n) {
+            char* block = static_cast<char*>(p) - FramePool::kHeader;
+            (*reinterpret_cast<FramePool**>(block))->deallocate(block, n + FramePool::kHeader);
+        }
+    };
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Behavior(Behavior&& o) noexcept : h(std::exchange(o.h, {})) {}
+    Behavior(const Behavior&) = delete;
+    Behavior& operator=(const Behavior&) = delete;
+    ~Behavior() { if (h) h.destroy(); }
+    Handle release() { return std::exchange(h, {}); }
+
+private:
+    explicit Behavior(Handle handle) : h(handle) {}
+    Handle h;
+};
+
+class BehaviorKernel {
+    static constexpr uint64_t kWheel = 256;
+    FramePool frames;  // Declared first so it outlives the frames destroyed below
+    struct Wake {
+        uint64_t cycle;
+        uint64_t order;
+        Behavior::Handle h;
+        bool operator>(const Wake& o) const { return cycle != o.cycle ? cycle > o.cycle : order > o.order; }
+    };
+    std::vector<Behavior::Handle> wheel[kWheel];  // Slot c % kWheel holds wakes at cycle c, c - now < kWheel
+    std::priority_queue<Wake, std::vector<Wake>, std::greater<Wake>> overflow;  // Wakes further out
+    std::vector<Behavior::Handle> due;
+    uint64_t now = 0, nextOrder = 0;
+    size_t inWheel = 0;
+
+    void resume(Behavior::Handle h) {
+        h.resume();
+        if (h.done()) h.destroy();
+    }
+
+public:
+    BehaviorKernel() {}
+    BehaviorKernel(const BehaviorKernel&) = delete;
+    BehaviorKernel& operator=(const BehaviorKernel&) = delete;
+    ~BehaviorKernel() {
+        for (auto& slot : wheel)
+            for (Behavior::Handle h : slot)
+                h.destroy();
+        for (; !overflow.empty(); overflow.pop())
+            overflow.top().h.destroy();
+    }
+
+    void spawn(Behavior b, uint64_t firstCycle) {
+        Behavior::Handle h = b.release();
+        h.promise().kernel = this;
+        schedule(h, firstCycle);
+    }
+
+    void schedule(Behavior::Handle h, uint64_t cycle) {
+        if (cycle > now && cycle - now < kWheel) {
+            wheel[cycle % kWheel].push_back(h);
+            ++inWheel;
+        } else {
+            overflow.push({cycle, nextOrder++, h});
+        }
+    }
+
+    uint64_t cycle() const { return now; }
+    size_t pending() const { return inWheel + overflow.size(); }
+    FramePool& framePool() { return frames; }
+
+    // Earliest cycle with a wake, or UINT64_MAX if none
+    uint64_t nextWake() const {
+        uint64_t far = overflow.empty() ? std::numeric_limits<uint64_t>::max() : overflow.top().cycle;
+        for (uint64_t c = now + 1; inWheel && c < now + kWheel && c < far; ++c)
+            if (!wheel[c % kWheel].empty()) return c;
+        return far;
+    }
+
+    // Resumes every behavior due by `cycle`, cycle by cycle: far wakes first,
+    // then near ones in the order they were scheduled. Returns how many ran.
+    size_t runUntil(uint64_t cycle) {
+        size_t resumed = 0;
+        while (now < cycle) {
+            if (inWheel == 0) {  // Nothing near: jump to the next far wake
+                uint64_t next = overflow.empty() ? cycle : std::min(cycle, overflow.top().cycle);
+                now = std::max(now + 1, next);
+            } else {
+                ++now;
+            }
+            while (!overflow.empty() && overflow.top().cycle <= now) {
+                Behavior::Handle h = overflow.top().h;
+                overflow.pop();
+                resume(h);
+                ++resumed;
+            }
+            // Swap the slot out: a behavior sleeping kWheel cycles lands back in it
+            due.swap(wheel[now % kWheel]);
+            inWheel -= due.size();
+            for (Behavior::Handle h : due)
+                resume(h);
+            resumed += due.size();
+            due.clear();
+        }
+        return resumed;
+    }
+};
+
+// co_await sleepCycles(n): resume at the start of the cycle n cycles from now (n >= 1)
+struct SleepCycles {
+    uint64_t n;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(Behavior::Handle h) const {
+        BehaviorKernel* k = h.promise().kernel;
+        k->schedule(h, k->cycle() + std::max<uint64_t>(1, n));
+    }
+    void await_resume() const noexcept {}
+};
+inline SleepCycles sleepCycles(uint64_t n) { return {n}; }
+#endif
+
+// -------------------------
+// GridManager Class: Core controller
+// -------------------------
+class GridManager {
+    GridState st;
+    TaskScheduler* scheduler = nullptr;  // Parallel runtime for large silent cycles
+    std::vector<float> chunkDemand;      // Per-chunk partial sums, reduced within each shard
+    std::vector<float> shardDemand;      // Per-NUMA-shard sums, combined in shard order
+    std::vector<float> chunkRequested;   // Per-chunk demand of every load, shed or not
+    std::vector<float> shardRequested;
+    std::vector<int> chunkHome;          // Node each load chunk was last placed on, -1 if never
+    // Input-change tracking: one bit per load chunk or source whose cached
+    // contribution is stale. measure() re-sums only what is marked, so a cycle
+    // costs in proportion to what changed rather than to the size of the grid.
+    struct DirtySet {
+        std::vector<uint64_t> words;
+        size_t marked = 0;
+        void mark(size_t i) {
+            if ((i >> 6) >= words.size()) words.resize((i >> 6) + 1, 0);
+            const uint64_t bit = uint64_t(1) << (i & 63);
+            if (!(words[i >> 6] & bit)) {
+                words[i >> 6] |= bit;
+                ++marked;
+            }
+        }
+        bool test(size_t i) const { return (i >> 6) < words.size() && (words[i >> 6] >> (i & 63) & 1); }
+        void clear() {
+            if (marked) std::fill(words.begin(), words.end(), 0);
+            marked = 0;
+        }
+    };
+    DirtySet dirtyChunks, dirtySources;
+    std::vector<uint32_t> chunkIdle;          // Loads per chunk that are off but not tripped (reconnect candidates)
+    std::vector<float> sourceContribution;    // Cached kW each source added to the last total
+    bool allDirty = true;                     // Caches are empty or belong to another state
+    bool fullRecompute = fullRecomputeDefault();  // Validation: ignore the caches every cycle
+    AggregationTree tree;                     // Subtree totals, built on first use after a topology change
+    std::unique_ptr<DemandForecast> forecast;  // Learns from the live grid only; forks start without one
+    BidCurve bids;                            // Demand response offers, sorted on first call after enrolment
+    std::vector<uint32_t> called;             // Enrolments called on during this balance
+    std::vector<float> calledKW;              // kW each enrolment was called for this balance, by enrolment
+    // Dispatch of ramped sources and storage: greedy each cycle, or planned
+    // over mpcHorizon cycles when that is non-zero
+    std::vector<uint32_t> rampedUnits, storageUnits;
+    std::vector<uint8_t> unitSource;  // Per source: 1 for a ramped source or storage unit
+    bool unitsKnown = false;
+    uint32_t mpcHorizon = 0;
+    double mpcBudgetMs = 2.0;
+    uint64_t mpcSolves = 0, mpcFallbacks = 0;
+    double mpcSolveMs = 0;
+    LinearProgram mpcProgram;
+    float measuredPower = 0, measuredDemand = 0;  // Carried from measure() to balance()
+    float measuredRequested = 0;                  // Demand of all loads, including tripped and disconnected ones
+#ifdef SMARTGRID_COROUTINES
+    // Not part of GridState: forks and undo leave behaviors alone. Created by
+    // the first behavior, so grids without any don't carry the wheel.
+    std::unique_ptr<BehaviorKernel> behaviors;
+    BehaviorKernel& kernel() {
+        if (!behaviors) behaviors = std::make_unique<BehaviorKernel>();
+        return *behaviors;
+    }
+#endif
+    bool fluctuating = false;  // A live source may change output on its own (set by measure)
+    bool cycleInputs = false;  // Commands or behaviors acted during the last measure
+    bool steady = false;       // The last cycle changed nothing and nothing has changed since
+    uint64_t skippedCycles = 0;
+    std::ostream* out = &std::cout;
+    std::ostream silent{nullptr};                          // Sink used by setOutput(nullptr)
+    FlightRecorder* recorder = &FlightRecorder::instance();  // Only the live grid records
+    std::vector<GridObserver*> observers;
+    GridSnapshot published;   // Refreshed in place by publish()
+    bool namesStale = true;   // A component was added or the state swapped since the last publish
+    struct HistoryEntry {
+        GridState state;     // Shares every chunk the action did not touch
+        std::string action;
+    };
+    std::deque<HistoryEntry> undoHistory, redoHistory;
+    size_t historyLimit = 64;
+    bool actionOpen = false;  // Between checkpoint() and endAction(); its cycles belong to the action
+    std::mutex commandMutex;                              // Remote commands arrive from other threads
+    std::vector<std::pair<std::string, bool>> remoteCommands;  // (breaker, trip?) queued until next cycle
+    std::atomic<bool> commandsQueued{false};                   // Lets protect() skip the lock
+
+    void record(FlightEvent kind, float a, float b, const std::string& name) {
+        if (recorder) recorder->record(kind, st.cycle, a, b, name);
+    }
+
+    bool verbose() const { return out != &silent; }
+
+    // Load column writers mark the load's chunk so the next measure() re-sums it,
+    // and the path above the load's topology node
+    void markLoad(size_t i) {
+        dirtyChunks.mark(i >> CowColumn<float>::kChunkBits);
+        if (tree.isBuilt() && i < st.loadNode.size()) tree.touch(st.loadNode[i]);
+        if (st.drLoad.size() && i < st.loadEnrolment.size() && st.loadEnrolment[i] != GridState::kNotEnrolled)
+            bids.touch(st.loadEnrolment[i]);
+    }
+
+    void setContribution(size_t i, float kW) {
+        if (sourceContribution[i] == kW) return;
+        sourceContribution[i] = kW;
+        if (tree.isBuilt()) tree.touch(st.sourceNode[i]);
+    }
+
+    // Class indices in shedding order (highest priority number first) or in
+    // reconnection order; ties keep the order the classes were added in
+    std::vector<uint32_t> classesByPriority(bool shedOrder) const {
+        std::vector<uint32_t> order(st.classNames.size());
+        for (uint32_t c = 0; c < order.size(); ++c)
+            order[c] = c;
+        const auto& priority = st.classPriority;
+        std::stable_sort(order.begin(), order.end(), [&priority, shedOrder](uint32_t a, uint32_t b) {
+            return shedOrder ? priority[a] > priority[b] : priority[a] < priority[b];
+        });
+        return order;
+    }
+
+    // Trips just enough online instances of class c to cover the deficit
+    void shedClass(uint32_t c, float totalPower, float& totalDemand, CycleStats& stats) {
+        const uint32_t online = st.classOnline[c];
+        const float each = st.classDemand[c];
+        if (!online || each <= 0) return;
+        uint32_t k = static_cast<uint32_t>(std::min<double>(online, std::ceil((totalDemand - totalPower) / each)));
+        while (k < online && totalPower < totalDemand - static_cast<float>(k) * each)
+            ++k;
+        st.classOnline.mut(c) -= k;
+        st.classTripped.mut(c) += k;
+        totalDemand -= static_cast<float>(k) * each;
+        *out << "[Trip] " << k << " of " << st.classNames[c] << " tripped due to overload.\n";
+        record(FlightEvent::Trip, static_cast<float>(k) * each, static_cast<float>(k), st.classNames[c]);
+        stats.trips += k;
+        if (stats.minTripPriority < 0 || st.classPriority[c] < stats.minTripPriority)
+            stats.minTripPriority = st.classPriority[c];
+    }
+
+    // Brings back as many idle instances of class c as the surplus covers
+    void reconnectClass(uint32_t c, float totalPower, float& totalDemand, CycleStats& stats) {
+        const uint32_t idle = st.classIdle[c];
+        const float each = st.classDemand[c];
+        if (!idle) return;
+        uint32_t k = idle;
+        if (each > 0) {
+            k = static_cast<uint32_t>(std::min<double>(idle, std::max<double>(0.0, std::floor((totalPower - totalDemand) / each))));
+            while (k > 0 && totalPower < totalDemand + static_cast<float>(k) * each)
+                --k;
+        }
+        if (!k) return;
+        st.classIdle.mut(c) -= k;
+        st.classOnline.mut(c) += k;
+        totalDemand += static_cast<float>(k) * each;
+        *out << "[Reconnect] " << k << " of " << st.classNames[c] << " reconnected.\n";
+        record(FlightEvent::Reconnect, static_cast<float>(k) * each, static_cast<float>(k), st.classNames[c]);
+        stats.reconnects += k;
+    }
+
+    // Sheds by priority inside each subtree drawing more than its rating.
+    // Children come after their parents, so walking the rated nodes backwards
+    // relieves transformers before deciding whether their feeder is still over.
+    void enforceRatings(std::ostream& os, CycleStats& stats, float& totalDemand) {
+        AggregationTree& t = builtTree();
+        const std::vector<uint32_t>& rated = t.ratedNodes();
+        for (auto it = rated.rbegin(); it != rated.rend(); ++it) {
+            const float rating = st.nodeRating[*it];
+            float demand = t.query(*it, st, sourceContribution).demand;
+            if (demand <= rating) continue;
+            os << "[Warning] " << st.nodeNames[*it] << " over its " << rating << "kW rating (" << demand
+               << "kW). Tripping loads below it by priority.\n";
+            std::vector<uint32_t> below;
+            t.loadsUnder(*it, below);
+            below.erase(std::remove_if(below.begin(), below.end(), [this](uint32_t i) { return !st.loadConnected[i] || st.loadTripped[i]; }),
+                        below.end());
+            const auto& priority = st.loadPriority;
+            std::sort(below.begin(), below.end(), [&priority](uint32_t a, uint32_t b) {
+                return priority[a] != priority[b] ? priority[a] > priority[b] : a < b;
+            });
+            for (uint32_t i : below) {
+                connectedAt(i) = 0;
+                trippedAt(i) = 1;
+                os << "[Trip] Load " << st.loadNames[i] << " tripped by " << st.nodeNames[*it] << " rating.\n";
+                record(FlightEvent::Trip, st.loadDemand[i], 0, st.loadNames[i]);
+                ++stats.trips;
+                if (stats.minTripPriority < 0 || st.loadPriority[i] < stats.minTripPriority)
+                    stats.minTripPriority = st.loadPriority[i];
+                demand -= st.loadDemand[i];
+                totalDemand -= shedDraw(i, stats);
+                if (demand <= rating) break;
+            }
+        }
+    }
+
+    // After the state is swapped wholesale nothing cached can be trusted
+    void invalidateCaches() {
+        allDirty = true;
+        tree.invalidate();
+        bids.invalidate();
+        unitsKnown = false;
+        chunkHome.clear();  // Swapped-in chunks were placed by whoever built them
+        namesStale = true;
+    }
+
+    // Relieves up to kW by calling on enrolled loads, cheapest offer first,
+    // and returns the kW relieved. Curtailed energy counts against a load's
+    // budget; shifted energy is owed until repayDeferred() serves it.
+    float callResponse(float kW, CycleStats& stats) {
+        TraceSpan span("response", "control");
+        bids.refresh(st);
+        const size_t k = bids.cover(kW);
+        double relieved = 0;
+        for (size_t j = 0; j < k && relieved < kW; ++j) {
+            const float share = static_cast<float>(std::min<double>(bids.offeredAt(j), kW - relieved));
+            if (share <= 0) continue;
+            const uint32_t e = bids.at(j);
+            if (calledKW.size() < st.drLoad.size()) calledKW.resize(st.drLoad.size(), 0.0f);
+            calledKW[e] = share;
+            called.push_back(e);
+            if (st.drWindow[e] && !st.drOwedSince[e]) {
+                st.drOwedSince.mut(e) = st.cycle;
+                bids.debtors(st).push_back(e);
+            }
+            const float used = st.drUsed.mut(e) += share;
+            // The offer only changes once the budget is what limits it
+            if (st.drBudget[e] - used < bids.offeredAt(j)) bids.touch(e);
+            relieved += share;
+        }
+        if (called.empty()) return 0;
+        *out << "[Response] Called " << called.size() << " enrolled load(s) for " << relieved << "kW, marginal price "
+             << st.drPrice[called.back()] << "/kW\n";
+        record(FlightEvent::Response, static_cast<float>(relieved), static_cast<float>(called.size()), "demand-response");
+        stats.responded += static_cast<float>(relieved);
+        return static_cast<float>(relieved);
+    }
+
+    // kW that shedding load i takes off the demand. A load called on this
+    // balance was already relieved of part of it, so that call is undone.
+    float shedDraw(uint32_t i, CycleStats& stats) {
+        float kW = st.loadDemand[i];
+        if (called.empty() || st.loadEnrolment[i] == GridState::kNotEnrolled) return kW;
+        const uint32_t e = st.loadEnrolment[i];
+        const float share = calledKW[e];
+        if (share <= 0) return kW;
+        calledKW[e] = 0;
+        st.drUsed.mut(e) -= share;
+        bids.touch(e);
+        stats.responded -= share;
+        return kW - share;
+    }
+
+    void endResponseCalls() {
+        for (uint32_t e : called)
+            calledKW[e] = 0;
+        called.clear();
+    }
+
+    // Serves demand deferred by shiftable loads, oldest first, each drawing
+    // at most its own demand again per cycle. Overdue debts are served
+    // whatever the balance; the rest only from up to `room` kW of surplus.
+    // Returns the kW added to demand.
+    float repayDeferred(float room, bool overdue, CycleStats& stats) {
+        std::vector<uint32_t>& owing = bids.debtors(st);
+        if (owing.empty()) return 0;
+        double repaid = 0;
+        size_t kept = 0;
+        uint32_t loads = 0;
+        for (uint32_t e : owing) {
+            const uint32_t i = st.drLoad[e];
+            const bool due = st.cycle - st.drOwedSince[e] >= st.drWindow[e];
+            float share = 0;
+            if (due == overdue && st.loadConnected[i] && !st.loadTripped[i]) {
+                share = std::min(st.drUsed[e], st.loadDemand[i]);
+                if (!overdue) share = static_cast<float>(std::min<double>(share, std::max<double>(0.0, room - repaid)));
+            }
+            if (share > 0) {
+                st.drUsed.mut(e) -= share;
+                bids.touch(e);
+                repaid += share;
+                ++loads;
+            }
+            if (st.drUsed[e] > 0) owing[kept++] = e;
+            else st.drOwedSince.mut(e) = 0;
+        }
+        owing.resize(kept);
+        if (!loads) return 0;
+        *out << "[Response] " << loads << " load(s) took back " << repaid << "kW of deferred demand"
+             << (overdue ? " at the end of their window" : "") << "\n";
+        stats.repaid += static_cast<float>(repaid);
+        return static_cast<float>(repaid);
+    }
+
+    void findUnits() {
+        rampedUnits.clear();
+        storageUnits.clear();
+        unitSource.assign(st.sources.size(), 0);
+        for (uint32_t i = 0; i < st.sources.size(); ++i) {
+            if (dynamic_cast<const RampedSource*>(st.sources[i].get())) rampedUnits.push_back(i);
+            else if (dynamic_cast<const StorageUnit*>(st.sources[i].get())) storageUnits.push_back(i);
+            else continue;
+            unitSource[i] = 1;
+        }
+        const auto& sources = st.sources;
+        std::stable_sort(rampedUnits.begin(), rampedUnits.end(), [&sources](uint32_t a, uint32_t b) {
+            return static_cast<const RampedSource&>(*sources[a]).getCost() < static_cast<const RampedSource&>(*sources[b]).getCost();
+        });
+        unitsKnown = true;
+    }
+
+    // Simulates source i, or reuses its cached output when it is clean and
+    // steady, and adds it to the running totals
+    void runSource(size_t i, bool everything, float& totalPower, float& solarPower) {
+        if (!everything && !dirtySources.test(i) && (st.sourceTripped[i] || !st.sources[i]->fluctuates())) {
+            totalPower += sourceContribution[i];
+            return;
+        }
+        float kW = 0;
+        if (!st.sourceTripped[i]) {
+            PowerComponent& src = mutableSource(i);
+            src.simulate(*out);
+            if (src.fluctuates() && src.isConnected()) fluctuating = true;
+            PowerSource* ps = dynamic_cast<PowerSource*>(&src);
+            if (ps && src.isConnected()) kW = ps->getPowerOutput();
+        }
+        setContribution(i, kW);
+        totalPower += kW;
+        if (st.sources[i]->isSolar()) solarPower += kW;
+    }
+
+    // Sets this cycle's output of every ramped source and storage unit. The
+    // first step covers this cycle's demand less what the other sources
+    // already supply; later steps of a plan use the forecast when there is
+    // one. Returns true if any output changed.
+    bool dispatchUnits(std::ostream& os, float demandKW, float supplyKW) {
+        TraceSpan span("dispatch", "control");
+        float solar = 0;
+        for (uint32_t i = 0; i < sourceContribution.size(); ++i)
+            if (st.sources[i]->isSolar()) solar += sourceContribution[i];
+        const float firm = supplyKW - solar;
+        // Net demand the units must cover k cycles from now. The forecast was
+        // last fed the previous cycle, so this cycle is one step ahead of it;
+        // without a forecast this cycle is assumed to repeat.
+        std::vector<float> net(std::max<uint32_t>(1, mpcHorizon));
+        net[0] = demandKW - supplyKW;
+        for (uint32_t k = 1; k < net.size(); ++k)
+            net[k] = forecast ? forecast->demandAhead(k + 1) - forecast->solarAhead(k + 1) - firm : net[0];
+        std::vector<float> before, after;
+        for (uint32_t i : rampedUnits) before.push_back(static_cast<const PowerSource&>(*st.sources[i]).getPowerOutput());
+        for (uint32_t i : storageUnits) before.push_back(static_cast<const PowerSource&>(*st.sources[i]).getPowerOutput());
+
+        const char* mode = "greedy";
+        if (mpcHorizon && planHorizon(net)) {
+            mode = "mpc";
+        } else {
+            if (mpcHorizon) ++mpcFallbacks;
+            // Cheapest ramped source first, storage covers the rest or soaks up the surplus
+            float rest = net[0];
+            for (uint32_t i : rampedUnits)
+                rest -= static_cast<RampedSource&>(mutableSource(i)).dispatch(rest);
+            for (uint32_t i : storageUnits)
+                rest -= static_cast<StorageUnit&>(mutableSource(i)).dispatch(rest);
+        }
+
+        os << "[Dispatch] " << mode << ":";
+        for (uint32_t i : rampedUnits) {
+            after.push_back(static_cast<const PowerSource&>(*st.sources[i]).getPowerOutput());
+            os << " " << st.sources[i]->getName() << " " << after.back() << "kW";
+        }
+        for (uint32_t i : storageUnits) {
+            after.push_back(static_cast<const PowerSource&>(*st.sources[i]).getPowerOutput());
+            os << " " << st.sources[i]->getName() << " " << after.back() << "kW";
+        }
+        os << "\n";
+        return before != after;
+    }
+
+    // Receding-horizon plan: an LP over the next net.size() cycles choosing
+    // each ramped source's output, each battery's charge and discharge, and
+    // the demand left unserved. Only the first cycle's settings are applied;
+    // the plan is rebuilt from fresh forecasts next cycle. Returns false if
+    // no plan was found within mpcBudgetMs.
+    bool planHorizon(const std::vector<float>& net) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto deadline = start + std::chrono::microseconds(static_cast<int64_t>(mpcBudgetMs * 1000.0));
+        const uint32_t h = static_cast<uint32_t>(net.size());
+        const double kShedCost = 1e4;   // Unserved kW; far above any fuel cost
+        const double kCycleCost = 1e-3;  // Keeps a battery from charging and discharging at once
+        // Stored energy is worth what the cheapest ramped source would charge
+        // for it, so the plan keeps it for what those sources cannot cover
+        const double storedValue = rampedUnits.empty() ? 0.0
+            : static_cast<const RampedSource&>(*st.sources[rampedUnits.front()]).getCost();
+        LinearProgram& lp = mpcProgram;
+        lp.clear();
+        std::vector<uint32_t> gen(rampedUnits.size() * h), charge(storageUnits.size() * h), discharge(charge.size());
+        std::vector<uint32_t> shed(h);
+        for (uint32_t k = 0; k < h; ++k) {
+            LinearProgram::Terms balance;
+            for (size_t u = 0; u < rampedUnits.size(); ++u) {
+                const auto& unit = static_cast<const RampedSource&>(*st.sources[rampedUnits[u]]);
+                const uint32_t g = gen[u * h + k] = lp.addVariable(unit.getCost());
+                balance.push_back({g, 1.0});
+                lp.addRow({{g, 1.0}}, LinearProgram::Le, unit.getMaxKW());
+                // Ramp limits against the previous cycle, or the current output for k == 0
+                if (k == 0) {
+                    lp.addRow({{g, 1.0}}, LinearProgram::Le, unit.getPowerOutput() + unit.getRampKW());
+                    lp.addRow({{g, 1.0}}, LinearProgram::Ge, unit.getPowerOutput() - unit.getRampKW());
+                } else {
+                    const uint32_t prev = gen[u * h + k - 1];
+                    lp.addRow({{g, 1.0}, {prev, -1.0}}, LinearProgram::Le, unit.getRampKW());
+                    lp.addRow({{g, 1.0}, {prev, -1.0}}, LinearProgram::Ge, -unit.getRampKW());
+                }
+            }
+            for (size_t b = 0; b < storageUnits.size(); ++b) {
+                const auto& unit = static_cast<const StorageUnit&>(*st.sources[storageUnits[b]]);
+                const uint32_t c = charge[b * h + k] = lp.addVariable(kCycleCost);
+                const uint32_t d = discharge[b * h + k] = lp.addVariable(kCycleCost + storedValue);
+                balance.push_back({d, 1.0});
+                balance.push_back({c, -1.0});
+                lp.addRow({{c, 1.0}}, LinearProgram::Le, unit.getRateKW());
+                lp.addRow({{d, 1.0}}, LinearProgram::Le, unit.getRateKW());
+                // Stored energy after cycle k stays within [0, capacity]
+                LinearProgram::Terms drawn;
+                for (uint32_t j = 0; j <= k; ++j) {
+                    drawn.push_back({discharge[b * h + j], 1.0});
+                    drawn.push_back({charge[b * h + j], -1.0});
+                }
+                lp.addRow(drawn, LinearProgram::Le, unit.getStored());
+                lp.addRow(std::move(drawn), LinearProgram::Ge, unit.getStored() - unit.getCapacity());
+            }
+            shed[k] = lp.addVariable(kShedCost);
+            balance.push_back({shed[k], 1.0});
+            // Surplus may be spilled, so supply only has to reach net demand
+            lp.addRow(std::move(balance), LinearProgram::Ge, net[k]);
+        }
+        std::vector<double> x;
+        const LinearProgram::Result res = lp.solve(deadline, x);
+        ++mpcSolves;
+        mpcSolveMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (res != LinearProgram::Result::Optimal) return false;
+        for (size_t u = 0; u < rampedUnits.size(); ++u)
+            static_cast<RampedSource&>(mutableSource(rampedUnits[u])).dispatch(static_cast<float>(x[gen[u * h]]));
+        for (size_t b = 0; b < storageUnits.size(); ++b)
+            static_cast<StorageUnit&>(mutableSource(storageUnits[b])).dispatch(static_cast<float>(x[discharge[b * h]] - x[charge[b * h]]));
+        return true;
+    }
+
+    AggregationTree& builtTree() {
+        if (!tree.isBuilt()) tree.rebuild(st);
+        return tree;
+    }
+    float& demandAt(size_t i) { markLoad(i); return st.loadDemand.mut(i); }
+    uint8_t& connectedAt(size_t i) { markLoad(i); return st.loadConnected.mut(i); }
+    uint8_t& trippedAt(size_t i) { markLoad(i); return st.loadTripped.mut(i); }
+
+    // Breaker state lives with the component that owns it
+    uint8_t* breakerFor(const std::string& name) {
+        const NameIndex::Ref* ref = st.index.find(name);
+        if (!ref) return nullptr;
+        if (!ref->isSource) return &trippedAt(ref->index);
+        dirtySources.mark(ref->index);
+        return &st.sourceTripped.mut(ref->index);
+    }
+
+    bool knownName(const std::string& name) const { return st.index.find(name) || st.classIndex.find(name); }
+
+    // Tripping a class trips all its instances; a reset leaves them off until
+    // balancing reconnects them, as for a single load
+    bool setBreaker(const std::string& name, bool trip) {
+        if (uint8_t* tripped = breakerFor(name)) {
+            *tripped = trip ? 1 : 0;
+            return true;
+        }
+        const NameIndex::Ref* ref = st.classIndex.find(name);
+        if (!ref) return false;
+        const uint32_t c = ref->index;
+        if (trip) {
+            st.classTripped.mut(c) += st.classOnline[c] + st.classIdle[c];
+            st.classOnline.mut(c) = 0;
+            st.classIdle.mut(c) = 0;
+        } else {
+            st.classIdle.mut(c) += st.classTripped[c];
+            st.classTripped.mut(c) = 0;
+        }
+        return true;
+    }
+
+    PowerComponent& mutableSource(size_t i) {
+        dirtySources.mark(i);
+        std::shared_ptr<PowerComponent>& src = st.sources.mut(i);
+        if (src.use_count() > 1) src = src->clone();
+        return *src;
+    }
+
+    // Returns true if any command was queued
+    bool applyRemoteCommands() {
+        TraceSpan span("remote-commands", "control");
+        std::vector<std::pair<std::string, bool>> pending;
+        {
+            std::lock_guard<std::mutex> lock(commandMutex);
+            pending.swap(remoteCommands);
+            commandsQueued.store(false, std::memory_order_relaxed);
+        }
+        for (const auto& [name, trip] : pending) {
+            if (!setBreaker(name, trip)) continue;
+            record(trip ? FlightEvent::RemoteTrip : FlightEvent::RemoteReset, 0, 0, name);
+            *out << "[Remote] Breaker " << name << (trip ? " tripped" : " reset") << ".\n";
+        }
+        return !pending.empty();
+    }
+
+    // Every mutation between cycles goes through here, so a steady grid notices it
+    void changed() {
+        steady = false;
+        publish();
+    }
+
+    void insertSource(PowerComponent* src) {
+        st.index.insert(src->getName(), {true, static_cast<uint32_t>(st.sources.size())});
+        dirtySources.mark(st.sources.size());
+        unitsKnown = false;
+        namesStale = true;
+        st.sources.push_back(std::shared_ptr<PowerComponent>(src));
+        st.sourceTripped.push_back(0);
+        st.sourceNode.push_back(GridState::kNoNode);
+    }
+
+    void insertLoad(const Load& l) {
+        st.index.insert(l.getName(), {false, static_cast<uint32_t>(st.loadNames.size())});
+        markLoad(st.loadNames.size());
+        namesStale = true;
+        st.loadNames.push_back(l.getName());
+        st.loadDemand.push_back(l.getRawDemand());
+        st.loadPriority.push_back(l.getPriority());
+        st.loadConnected.push_back(l.isConnected() ? 1 : 0);
+        st.loadTripped.push_back(0);
+        st.loadNode.push_back(GridState::kNoNode);
+        st.loadEnrolment.push_back(GridState::kNotEnrolled);
+    }
+
+    void applyFault(const std::string& name) {
+        auto faults = std::make_shared<std::set<std::string>>(*st.faults);
+        faults->insert(name);
+        st.faults = std::move(faults);
+        setBreaker(name, true);
+        *out << "[Fault] Injected at " << name << "\n";
+        record(FlightEvent::FaultInjected, 0, 0, name);
+    }
+
+    void clearFault(const std::string& name) {
+        auto faults = std::make_shared<std::set<std::string>>(*st.faults);
+        faults->erase(name);
+        st.faults = std::move(faults);
+        setBreaker(name, false);
+        *out << "[Fault] Resolved: " << name << "\n";
+        record(FlightEvent::FaultResolved, 0, 0, name);
+    }
+
+    const NameIndex::Ref* findLoadRef(const std::string& name) const {
+        const NameIndex::Ref* ref = st.index.find(name);
+        return ref && !ref->isSource ? ref : nullptr;
+    }
+
+    // Load chunks are split into one contiguous shard per NUMA node
+    static size_t shardBegin(size_t shard, size_t shards, size_t numChunks) { return numChunks * shard / shards; }
+
+    // First-touch placement: chunks whose shard changed since the last cycle are
+    // copied by a worker on the shard's node, so their pages land in its memory.
+    // Only chunks that moved are copied; the rest stay shared with forks and history.
+    void placeShards(size_t numChunks, size_t shards) {
+        std::vector<std::vector<size_t>> moves(shards);
+        chunkHome.resize(numChunks, -1);
+        for (size_t s = 0; s < shards; ++s) {
+            for (size_t c = shardBegin(s, shards, numChunks); c < shardBegin(s + 1, shards, numChunks); ++c) {
+                if (chunkHome[c] == static_cast<int>(s)) continue;
+                moves[s].push_back(c);
+                chunkHome[c] = static_cast<int>(s);
+            }
+        }
+        if (std::all_of(moves.begin(), moves.end(), [](const std::vector<size_t>& m) { return m.empty(); }))
+            return;
+        TraceSpan span("numa-place", "memory");
+        st.loadDemand.detach();
+        st.loadPriority.detach();
+        st.loadConnected.detach();
+        st.loadTripped.detach();
+        TaskScheduler::TaskGroup group(*scheduler);
+        for (size_t s = 0; s < shards; ++s) {
+            if (moves[s].empty()) continue;
+            group.runOn(scheduler->workerForNode(s), [this, &moves, s]() {
+                for (size_t c : moves[s]) {
+                    st.loadDemand.rehome(c);
+                    st.loadPriority.rehome(c);
+                    st.loadConnected.rehome(c);
+                    st.loadTripped.rehome(c);
+                }
+            });
+        }
+        group.wait();
+    }
+
+public:
+    GridManager() {}
+    // A branch of an existing state: silent and not recorded until told otherwise
+    explicit GridManager(const GridState& s) : st(s), out(&silent), recorder(nullptr) {}
+    GridManager(const GridManager&) = delete;
+    GridManager& operator=(const GridManager&) = delete;
+
+    void addSource(PowerComponent* src) {
+        insertSource(src);
+        simulate();
+    }
+
+    void addLoad(const Load& l) {
+        insertLoad(l);
+        changed();
+    }
+
+    // -------------------
+    // What-if Branching
+    // -------------------
+    // O(1): the branch shares every column chunk until one side writes to it
+    std::unique_ptr<GridManager> fork() const { return std::make_unique<GridManager>(st); }
+    const GridState& getState() const { return st; }
+    void restoreState(const GridState& s) {
+        st = s;
+        invalidateCaches();
+        changed();
+    }
+    void setOutput(std::ostream* os) { out = os ? os : &silent; }
+    // Silent cycles split their scans across the scheduler; nullptr runs serially
+    void setScheduler(TaskScheduler* s) { scheduler = s; }
+    // Re-sums every load and source each cycle instead of only the changed ones,
+    // for validating the dirty tracking against the plain computation
+    void setFullRecompute(bool on) { fullRecompute = on; }
+    // Default for grids created afterwards, including forks; set from --full-recompute
+    static bool& fullRecomputeDefault() {
+        static bool on = false;
+        return on;
+    }
+    std::ostream& output() { return *out; }
+
+#ifdef SMARTGRID_COROUTINES
+    // First resumed at the start of the next cycle. A behavior may change the
+    // grid through its setters and requestBreaker(), but must not run cycles.
+    void spawn(Behavior b) { kernel().spawn(std::move(b), st.cycle + 1); }
+    FramePool& framePool() { return kernel().framePool(); }
+    size_t behaviorCount() const { return behaviors ? behaviors->pending() : 0; }
+#endif
+
+    // -------------------
+    // Undo / Redo
+    // -------------------
+    // Each entry is a GridState value, so a checkpoint costs O(1) up front and
+    // afterwards only the chunks the action modifies. The cycle counter is a
+    // clock rather than grid state and keeps running across undo and redo.
+    // Restoring an entry would also revert every trip and reconnect made since,
+    // so a cycle run outside an action clears the history (see measure()).
+    void checkpoint(const std::string& action) {
+        undoHistory.push_back({st, action});
+        if (undoHistory.size() > historyLimit) undoHistory.pop_front();
+        redoHistory.clear();
+        actionOpen = true;
+    }
+
+    // Ends the action opened by checkpoint(); later cycles are the grid's own
+    void endAction() { actionOpen = false; }
+
+    bool undo() {
+        if (undoHistory.empty()) return false;
+        redoHistory.push_back({st, undoHistory.back().action});
+        *out << "[Undo] Reverted: " << undoHistory.back().action << "\n";
+        uint64_t now = st.cycle;
+        st = std::move(undoHistory.back().state);
+        st.cycle = now;
+        undoHistory.pop_back();
+        invalidateCaches();
+        changed();
+        return true;
+    }
+
+    bool redo() {
+        if (redoHistory.empty()) return false;
+        undoHistory.push_back({st, redoHistory.back().action});
+        *out << "[Redo] Reapplied: " << redoHistory.back().action << "\n";
+        uint64_t now = st.cycle;
+        st = std::move(redoHistory.back().state);
+        st.cycle = now;
+        redoHistory.pop_back();
+        invalidateCaches();
+        changed();
+        return true;
+    }
+
+    void setHistoryLimit(size_t n) {
+        historyLimit = n;
+        while (undoHistory.size() > historyLimit) undoHistory.pop_front();
+    }
+
+    // -------------------
+    // Transactions
+    // -------------------
+    // Validates every staged action against the grid plus the actions before it.
+    // On success all actions are applied, followed by a single balancing cycle;
+    // on failure nothing changes and `error` describes the first bad action.
+    bool commit(GridTransaction& tx, std::string& error) {
+        TraceSpan span("transaction", "control");
+        std::unordered_set<std::string> newNames, newLoads, newFaults, resolved;
+        std::unordered_set<std::string> instances;   // Class instances to materialize, as outside a transaction
+        std::unordered_map<uint32_t, uint32_t> claimed;  // Instances taken from each class so far
+        for (size_t i = 0; i < tx.actions.size(); ++i) {
+            const auto& a = tx.actions[i];
+            using Kind = GridTransaction::Kind;
+            if (a.kind != Kind::AddLoad && a.kind != Kind::AddSource && !newNames.count(a.name) && !instances.count(a.name)) {
+                const long c = instanceClass(a.name);
+                if (c >= 0 && claimed[static_cast<uint32_t>(c)] < classRemaining(static_cast<uint32_t>(c))) {
+                    ++claimed[static_cast<uint32_t>(c)];
+                    instances.insert(a.name);
+                }
+            }
+            bool known = knownName(a.name) || newNames.count(a.name) || instances.count(a.name);
+            bool isLoad = findLoadRef(a.name) || newLoads.count(a.name) || instances.count(a.name);
+            bool faulted = (st.faults->count(a.name) && !resolved.count(a.name)) || newFaults.count(a.name);
+            const char* problem = nullptr;
+            switch (a.kind) {
+            case Kind::AddLoad:
+            case Kind::AddSource:
+                if (known) problem = "name already in use";
+                else if (a.kind == Kind::AddLoad && a.value < 0) problem = "negative demand";
+                newNames.insert(a.name);
+                if (a.kind == Kind::AddLoad) newLoads.insert(a.name);
+                break;
+            case Kind::Disconnect:
+            case Kind::Reconnect:
+                if (!isLoad) problem = "no such load";
+                break;
+            case Kind::SetDemand:
+                if (!isLoad) problem = "no such load";
+                else if (a.value < 0) problem = "negative demand";
+                break;
+            case Kind::Trip:
+            case Kind::Reset:
+                if (!known) problem = "no such breaker";
+                break;
+            case Kind::Fault:
+                if (!known) problem = "no such breaker";
+                newFaults.insert(a.name);
+                resolved.erase(a.name);
+                break;
+            case Kind::Resolve:
+                if (!faulted) problem = "no active fault";
+                newFaults.erase(a.name);
+                resolved.insert(a.name);
+                break;
+            }
+            if (problem) {
+                error = "action " + std::to_string(i) + " (" + a.name + "): " + problem;
+                return false;
+            }
+        }
+
+        for (auto& a : tx.actions) {
+            using Kind = GridTransaction::Kind;
+            if (instances.count(a.name)) materialize(a.name);  // No-op once it is a load
+            switch (a.kind) {
+            case Kind::AddLoad: insertLoad(Load(a.name, a.value, a.priority)); break;
+            case Kind::AddSource: insertSource(a.source); a.source = nullptr; break;
+            case Kind::Disconnect: connectedAt(findLoadRef(a.name)->index) = 0; break;
+            case Kind::Reconnect: connectedAt(findLoadRef(a.name)->index) = 1; break;
+            case Kind::SetDemand: demandAt(findLoadRef(a.name)->index) = a.value; break;
+            case Kind::Trip: setBreaker(a.name, true); break;
+            case Kind::Reset: setBreaker(a.name, false); break;
+            case Kind::Fault: applyFault(a.name); break;
+            case Kind::Resolve: clearFault(a.name); break;
+            }
+        }
+        *out << "[Transaction] Committed " << tx.actions.size() << " actions.\n";
+        tx.actions.clear();
+        simulate();
+        return true;
+    }
+
+    // -------------------
+    // Observers and Remote Control
+    // -------------------
+    void addObserver(GridObserver* o) {
+        observers.push_back(o);
+        namesStale = true;  // The new observer has not seen any names yet
+        publish();
+    }
+
+    // Thread-safe: the command is applied at the start of the next simulation cycle
+    void requestBreaker(const std::string& name, bool trip) {
+        std::lock_guard<std::mutex> lock(commandMutex);
+        remoteCommands.emplace_back(name, trip);
+        commandsQueued.store(true, std::memory_order_release);
+    }
+
+    GridSnapshot snapshot() const {
+        GridSnapshot snap;
+        fillSnapshot(snap, true);
+        return snap;
+    }
+
+    // Updates `snap` in place. Names and kinds are only rewritten with `names`
+    // set; otherwise just the numeric fields change and nothing is allocated.
+    void fillSnapshot(GridSnapshot& snap, bool names) const {
+        const size_t sources = st.sources.size();
+        snap.components.resize(sources + st.loadNames.size());
+        snap.topologyChanged = names;
+        for (size_t i = 0; i < sources; ++i) {
+            const PowerComponent& src = *st.sources[i];
+            GridSnapshot::Entry& e = snap.components[i];
+            if (names) {
+                e.name = src.getName();
+                e.isSource = true;
+                e.priority = 0;
+            }
+            const PowerSource* ps = dynamic_cast<const PowerSource*>(&src);
+            float output = ps ? ps->getPowerOutput() : 0.0f;
+            e.tripped = st.sourceTripped[i] != 0;
+            e.connected = src.isConnected();
+            e.rating = output;
+            e.flow = !e.tripped && e.connected ? output : 0.0f;
+        }
+        for (size_t i = 0; i < st.loadNames.size(); ++i) {
+            GridSnapshot::Entry& e = snap.components[sources + i];
+            if (names) {
+                e.name = st.loadNames[i];
+                e.isSource = false;
+            }
+            e.tripped = st.loadTripped[i] != 0;
+            e.connected = st.loadConnected[i] != 0;
+            e.rating = st.loadDemand[i];
+            e.flow = !e.tripped && e.connected ? e.rating : 0.0f;
+            e.priority = st.loadPriority[i];
+        }
+    }
+
+    void publish() {
+        if (observers.empty()) return;
+        TraceSpan span("publish", "io");
+        fillSnapshot(published, namesStale);
+        namesStale = false;
+        for (auto o : observers)
+            o->onGridUpdate(published);
+    }
+
+    // Runs `cycles` cycles, fast-forwarding through steady state: once a cycle
+    // has changed nothing, with no fluctuating source, queued command or
+    // behavior due, every following cycle would repeat it exactly. The counter
+    // then jumps ahead with the last stats carried over, and the skipped span is
+    // logged and recorded. Returns the number of cycles actually simulated.
+    uint64_t advance(uint64_t cycles) {
+        uint64_t simulated = 0;
+        while (cycles > 0) {
+            uint64_t skippable = 0;
+            if (steady && !commandsQueued.load(std::memory_order_acquire)) {
+                skippable = cycles;
+#ifdef SMARTGRID_COROUTINES
+                uint64_t wake = behaviors ? behaviors->nextWake() : std::numeric_limits<uint64_t>::max();
+                if (wake != std::numeric_limits<uint64_t>::max())
+                    skippable = wake > st.cycle + 1 ? std::min(cycles, wake - st.cycle - 1) : 0;
+#endif
+            }
+            if (skippable == 0) {
+                simulate();
+                ++simulated;
+                --cycles;
+                continue;
+            }
+            TraceSpan span("fast-forward", "cycle");
+            st.cycle += skippable;
+            skippedCycles += skippable;
+            cycles -= skippable;
+            *out << "\n[Log] Steady state: fast-forwarded " << skippable << " cycles to cycle " << st.cycle << "\n";
+            record(FlightEvent::SteadySkip, static_cast<float>(skippable), 0, std::string());
+        }
+        return simulated;
+    }
+
+    uint64_t getSkippedCycles() const { return skippedCycles; }
+
+    // Protection pass for a fast loop: applies queued breaker commands between
+    // cycles without touching the load or source columns
+    void protect() {
+        if (commandsQueued.load(std::memory_order_acquire)) applyRemoteCommands();
+    }
+
+    //  Simulation logic using polymorphism
+    void simulate() {
+        TraceSpan cycleSpan("cycle", "cycle");
+        measure();
+        balance(0);
+    }
+
+    // A cycle in two stages so interconnected grids can trade power in between:
+    // measure() updates sources and totals the connected demand, then balance()
+    // sheds or reconnects loads against generation plus the tie-line import
+    // (negative when exporting).
+    void measure() {
+        if (!actionOpen) {
+            undoHistory.clear();
+            redoHistory.clear();
+        }
+        ++st.cycle;
+        std::ostream& os = *out;
+        os << "\n=== Cycle ===\n[Log] Simulation Start\n";
+#ifdef SMARTGRID_COROUTINES
+        cycleInputs = false;
+        if (behaviors && behaviors->pending()) {
+            TraceSpan span("behaviors", "control");
+            cycleInputs = behaviors->runUntil(st.cycle) > 0;
+        }
+#else
+        cycleInputs = false;
+#endif
+        if (applyRemoteCommands()) cycleInputs = true;
+        if (!unitsKnown) findUnits();
+        fluctuating = false;
+        float totalPower = 0, totalDemand = 0, solarPower = 0;
+        const size_t numLoads = st.loadNames.size();
+
+        // Verbose cycles print every component, so they walk everything anyway
+        const bool everything = allDirty || fullRecompute || verbose();
+        allDirty = false;
+
+        {
+            PhaseScope phase(CyclePhase::Sources, st.sources.size());
+            // A clean source that did not fluctuate last time has the same output;
+            // summing the cached contributions in source order keeps the total
+            // bit-identical to a full recompute.
+            sourceContribution.resize(st.sources.size(), 0.0f);
+            for (size_t i = 0; i < st.sources.size(); ++i) {
+                if (!unitSource[i]) runSource(i, everything, totalPower, solarPower);  // Units wait for the demand
+            }
+        }
+
+        {
+            PhaseScope phase(CyclePhase::Loads, numLoads);
+            // Demand is summed per chunk, the chunk partials of each NUMA shard are
+            // reduced in chunk order and the shard sums combined in shard order, so
+            // the total does not depend on how many threads ran the scan. Only
+            // marked chunks and the shards holding them are summed again.
+            const size_t numChunks = st.loadDemand.chunks();
+            const size_t shards = NumaTopology::instance().nodeCount();
+            const bool rescanAll = everything || chunkDemand.size() != numChunks || shardDemand.size() != shards;
+            chunkDemand.resize(numChunks, 0.0f);
+            chunkRequested.resize(numChunks, 0.0f);
+            chunkIdle.resize(numChunks, 0);
+            shardDemand.resize(shards, 0.0f);
+            shardRequested.resize(shards, 0.0f);
+            std::vector<uint8_t> shardDirty(shards, rescanAll ? 1 : 0);
+            size_t dirty = rescanAll ? numChunks : 0;
+            if (!rescanAll) {
+                for (size_t s = 0; s < shards; ++s)
+                    for (size_t c = shardBegin(s, shards, numChunks); c < shardBegin(s + 1, shards, numChunks); ++c)
+                        if (dirtyChunks.test(c)) {
+                            shardDirty[s] = 1;
+                            ++dirty;
+                        }
+            }
+            auto scan = [this, &os, rescanAll](size_t first, size_t last, bool printing) {
+                for (size_t c = first; c < last; ++c) {
+                    if (!rescanAll && !dirtyChunks.test(c)) continue;
+                    const size_t base = c << CowColumn<float>::kChunkBits, n = st.loadDemand.chunkLength(c);
+                    const float* demand = st.loadDemand.chunk(c);
+                    const uint8_t* connected = st.loadConnected.chunk(c);
+                    const uint8_t* tripped = st.loadTripped.chunk(c);
+                    float sum = 0, all = 0;
+                    uint32_t idle = 0;
+                    for (size_t j = 0; j < n; ++j) {
+                        all += demand[j];
+                        if (tripped[j]) continue;
+                        if (printing)
+                            os << "[Load] " << st.loadNames[base + j] << ": " << demand[j] << "kW, Priority: "
+                               << st.loadPriority[base + j] << ", Connected: " << (connected[j] ? "Yes" : "No") << "\n";
+                        if (connected[j]) sum += demand[j];
+                        else ++idle;
+                    }
+                    chunkDemand[c] = sum;
+                    chunkRequested[c] = all;
+                    chunkIdle[c] = idle;
+                }
+            };
+            auto reduceShard = [this, shards, numChunks, &shardDirty](size_t s) {
+                if (!shardDirty[s]) return;
+                shardDemand[s] = 0;
+                shardRequested[s] = 0;
+                for (size_t c = shardBegin(s, shards, numChunks); c < shardBegin(s + 1, shards, numChunks); ++c) {
+                    shardDemand[s] += chunkDemand[c];
+                    shardRequested[s] += chunkRequested[c];
+                }
+            };
+            if (dirty >= 16 && scheduler && !verbose() && !scheduler->inlineMode()) {
+                if (shards > 1) placeShards(numChunks, shards);
+                TaskScheduler::TaskGroup group(*scheduler);
+                for (size_t s = 0; s < shards; ++s) {
+                    if (!shardDirty[s]) continue;
+                    // Nested splits go to the shard worker's own deque, and thieves
+                    // on the same node get first pick of them
+                    group.runOn(scheduler->workerForNode(s), [this, &scan, &reduceShard, s, shards, numChunks]() {
+                        scheduler->parallelFor(shardBegin(s, shards, numChunks), shardBegin(s + 1, shards, numChunks), 16,
+                                               [&scan](size_t b, size_t e) { scan(b, e, false); });
+                        reduceShard(s);
+                    });
+                }
+                group.wait();
+            } else if (dirty) {
+                for (size_t s = 0; s < shards; ++s) {
+                    if (!shardDirty[s]) continue;
+                    scan(shardBegin(s, shards, numChunks), shardBegin(s + 1, shards, numChunks), verbose());
+                    reduceShard(s);
+                }
+            }
+            dirtyChunks.clear();
+            for (float partial : shardDemand)
+                totalDemand += partial;
+            measuredRequested = 0;
+            for (float partial : shardRequested)
+                measuredRequested += partial;
+            for (size_t c = 0; c < st.classNames.size(); ++c) {
+                if (verbose())
+                    os << "[Class] " << st.classNames[c] << ": " << st.classSize[c] << " x " << st.classDemand[c]
+                       << "kW, Priority: " << st.classPriority[c] << ", Online: " << st.classOnline[c] << ", Idle: "
+                       << st.classIdle[c] << ", Tripped: " << st.classTripped[c] << "\n";
+                totalDemand += static_cast<float>(st.classOnline[c]) * st.classDemand[c];
+                measuredRequested += static_cast<float>(st.classOnline[c] + st.classIdle[c] + st.classTripped[c]) * st.classDemand[c];
+            }
+        }
+
+        // Ramped sources and storage are set against this cycle's demand, then run
+        if (!rampedUnits.empty() || !storageUnits.empty()) {
+            if (dispatchUnits(os, totalDemand, totalPower)) cycleInputs = true;
+            for (size_t i = 0; i < st.sources.size(); ++i)
+                if (unitSource[i]) runSource(i, everything, totalPower, solarPower);
+        }
+        dirtySources.clear();
+
+        if (forecast) {
+            TraceSpan span("forecast", "control");
+            forecast->observeLoads(st);
+            forecast->observeTotals(totalDemand, solarPower);
+            if (st.nodeNames.size()) {
+                AggregationTree& t = builtTree();
+                for (uint32_t n = 0; n < st.nodeNames.size(); ++n)
+                    forecast->observeNode(n, t.query(n, st, sourceContribution).demand);
+            }
+        }
+
+        os << "[Log] Total Power: " << totalPower << "kW\n";
+        os << "[Log] Total Demand: " << totalDemand << "kW\n";
+        measuredPower = totalPower;
+        measuredDemand = totalDemand;
+    }
+
+    // Generation minus connected demand from the last measure(); negative is a deficit
+    float surplus() const { return measuredPower - measuredDemand; }
+
+    void balance(float importedKW) {
+        std::ostream& os = *out;
+        const size_t numLoads = st.loadNames.size();
+        float totalPower = measuredPower + importedKW, totalDemand = measuredDemand;
+        if (importedKW > 0) os << "[Tie] Imported " << importedKW << "kW\n";
+        else if (importedKW < 0) os << "[Tie] Exported " << -importedKW << "kW\n";
+        CycleStats stats;
+        stats.requested = measuredRequested;
+        stats.imported = importedKW;
+
+        {
+            PhaseScope phase(CyclePhase::Balance, numLoads);
+            const bool responders = st.drLoad.size() != 0;
+            if (responders) totalDemand += repayDeferred(0, true, stats);
+            // Flexible demand is called on before anything is shed
+            if (responders && totalPower < totalDemand) totalDemand -= callResponse(totalDemand - totalPower, stats);
+            // Load shedding logic
+            if (totalPower < totalDemand) {
+                os << "[Warning] Power Deficit Detected. Tripping loads based on priority.\n";
+                std::vector<uint32_t> sortedLoads;
+                for (size_t i = 0; i < numLoads; ++i)
+                    if (st.loadConnected[i]) sortedLoads.push_back(static_cast<uint32_t>(i));
+                const auto& priority = st.loadPriority;
+                std::sort(sortedLoads.begin(), sortedLoads.end(), [&priority](uint32_t a, uint32_t b) {
+                    return priority[a] > priority[b];
+                });
+
+                // Classes of a higher priority number than the next load go first
+                std::vector<uint32_t> classes = classesByPriority(true);
+                size_t nextClass = 0;
+                auto shedClassesAbove = [&](int priority) {
+                    for (; nextClass < classes.size() && st.classPriority[classes[nextClass]] > priority; ++nextClass) {
+                        shedClass(classes[nextClass], totalPower, totalDemand, stats);
+                        if (totalPower >= totalDemand) return true;
+                    }
+                    return false;
+                };
+                for (uint32_t i : sortedLoads) {
+                    if (shedClassesAbove(priority[i])) break;
+                    connectedAt(i) = 0;
+                    trippedAt(i) = 1;
+                    os << "[Trip] Load " << st.loadNames[i] << " tripped due to overload.\n";
+                    record(FlightEvent::Trip, st.loadDemand[i], 0, st.loadNames[i]);
+                    ++stats.trips;
+                    if (stats.minTripPriority < 0 || st.loadPriority[i] < stats.minTripPriority)
+                        stats.minTripPriority = st.loadPriority[i];
+                    totalDemand -= shedDraw(i, stats);
+                    if (totalPower >= totalDemand) break;
+                }
+                if (totalPower < totalDemand) shedClassesAbove(std::numeric_limits<int>::min());
+            } else {
+                // Reconnect loads in priority order. Only chunks measure() counted
+                // idle loads in, or that changed since, can hold a candidate.
+                std::vector<uint32_t> disconnectedLoads;
+                for (size_t c = 0; c < st.loadConnected.chunks(); ++c) {
+                    if (c < chunkIdle.size() && !chunkIdle[c] && !dirtyChunks.test(c)) continue;
+                    const size_t base = c << CowColumn<float>::kChunkBits;
+                    const size_t end = std::min(numLoads, base + st.loadConnected.chunkLength(c));
+                    for (size_t i = base; i < end; ++i)
+                        if (!st.loadConnected[i] && !st.loadTripped[i])
+                            disconnectedLoads.push_back(static_cast<uint32_t>(i));
+                }
+                const auto& priority = st.loadPriority;
+                std::sort(disconnectedLoads.begin(), disconnectedLoads.end(), [&priority](uint32_t a, uint32_t b) {
+                    return priority[a] < priority[b];
+                });
+
+                std::vector<uint32_t> classes = classesByPriority(false);
+                size_t nextClass = 0;
+                auto reconnectClassesBelow = [&](int priority) {
+                    for (; nextClass < classes.size() && st.classPriority[classes[nextClass]] < priority; ++nextClass)
+                        reconnectClass(classes[nextClass], totalPower, totalDemand, stats);
+                };
+                for (uint32_t i : disconnectedLoads) {
+                    reconnectClassesBelow(priority[i]);
+                    if (totalPower >= totalDemand + st.loadDemand[i]) {
+                        connectedAt(i) = 1;
+                        os << "[Reconnect] Load " << st.loadNames[i] << " reconnected.\n";
+                        record(FlightEvent::Reconnect, st.loadDemand[i], 0, st.loadNames[i]);
+                        ++stats.reconnects;
+                        totalDemand += st.loadDemand[i];
+                    }
+                }
+                reconnectClassesBelow(std::numeric_limits<int>::max());
+                if (responders) totalDemand += repayDeferred(totalPower - totalDemand, false, stats);
+            }
+            if (st.nodeNames.size()) enforceRatings(os, stats, totalDemand);
+            endResponseCalls();
+        }
+
+        for (const auto& f : *st.faults)
+            os << "[Log] Active Fault: " << f << "\n";
+
+        stats.power = measuredPower;
+        stats.demand = totalDemand;
+        st.last = stats;
+        // Deferred demand falls due as cycles pass, and a forecast learns from
+        // every cycle (its trend keeps moving even on a constant input, and
+        // dispatch reads it), so neither a grid that owes demand nor one that
+        // forecasts is ever steady
+        steady = !fluctuating && !cycleInputs && importedKW == 0 && stats.trips == 0 && stats.reconnects == 0 &&
+                 stats.responded == 0 && stats.repaid == 0 && (!st.drLoad.size() || bids.debtors(st).empty()) &&
+                 !forecast;
+        record(FlightEvent::Cycle, measuredPower, totalDemand, std::string());
+        os << "[Log] Simulation End\n";
+        publish();
+    }
+
+    // -------------------
+    // Manual Fault Controls
+    // -------------------
+    bool injectFault(const std::string& name) {
+        if (!knownName(name) && !materialize(name)) return false;
+        applyFault(name);
+        changed();
+        return true;
+    }
+
+    bool resolveFault(const std::string& name) {
+        if (!st.faults->count(name)) return false;
+        clearFault(name);
+        changed();
+        return true;
+    }
+
+    void injectManualFault(std::istream& in = std::cin, std::ostream& ui = std::cout) {
+        ui << "Select target to fault:\n";
+        for (size_t i = 0; i < st.loadNames.size(); ++i)
+            ui << "L" << i << ": Load: " << st.loadNames[i] << "\n";
+        for (size_t i = 0; i < st.sources.size(); ++i)
+            ui << "S" << i << ": Source: " << st.sources[i]->getName() << "\n";
+        std::string input;
+        in >> input;
+        std::string name;
+        if (input[0] == 'L') name = st.loadNames[std::stoul(input.substr(1))];
+        else if (input[0] == 'S') name = st.sources[std::stoul(input.substr(1))]->getName();
+        injectFault(name);
+    }
+
+    void resolveManualFault(std::istream& in = std::cin, std::ostream& ui = std::cout) {
+        ui << "Active faults:\n";
+        int i = 0;
+        for (const auto& f : *st.faults)
+            ui << i++ << ": " << f << "\n";
+        int index;
+        in >> index;
+        auto it = st.faults->begin();
+        std::advance(it, index);
+        resolveFault(std::string(*it));
+        simulate();
+    }
+
+    void disconnectLoad(size_t index) { connectedAt(index) = 0; changed(); }
+    void reconnectLoad(size_t index) { connectedAt(index) = 1; changed(); }
+    void setLoadDemand(size_t index, float demand) { demandAt(index) = demand; changed(); }
+    // -------------------
+    // Load Classes
+    // -------------------
+    // `count` identical loads cost one row. Shedding and reconnection move
+    // instances between the online, idle and tripped counts, so a class can be
+    // partly shed. An instance that must differ from its class is materialized
+    // as an ordinary load named "<class>:<k>".
+    bool addClass(const std::string& name, float demandKW, int priority, uint32_t count) {
+        if (knownName(name) || demandKW < 0) return false;
+        st.classIndex.insert(name, {false, static_cast<uint32_t>(st.classNames.size())});
+        st.classNames.push_back(name);
+        st.classDemand.push_back(demandKW);
+        st.classPriority.push_back(priority);
+        st.classSize.push_back(count);
+        st.classOnline.push_back(count);
+        st.classIdle.push_back(0);
+        st.classTripped.push_back(0);
+        changed();
+        return true;
+    }
+
+    // Class of instance "<class>:<k>" if that name is not a load yet, else -1
+    long instanceClass(const std::string& name) const {
+        const size_t colon = name.rfind(':');
+        if (colon == std::string::npos || colon + 1 == name.size() || st.index.find(name)) return -1;
+        const NameIndex::Ref* ref = st.classIndex.find(name.substr(0, colon));
+        if (!ref) return -1;
+        char* end = nullptr;
+        const unsigned long k = std::strtoul(name.c_str() + colon + 1, &end, 10);
+        if (*end || k >= st.classSize[ref->index]) return -1;
+        return ref->index;
+    }
+
+    // Instances still held as counts by class c
+    uint32_t classRemaining(uint32_t c) const { return st.classOnline[c] + st.classIdle[c] + st.classTripped[c]; }
+
+    // Splits instance "<class>:<k>" out of its class, keeping its state:
+    // online instances are taken first, then idle, then tripped ones
+    bool materialize(const std::string& name) {
+        const long found = instanceClass(name);
+        if (found < 0) return false;
+        const uint32_t c = static_cast<uint32_t>(found);
+        Load l(name, st.classDemand[c], st.classPriority[c]);
+        bool tripped = false;
+        if (st.classOnline[c]) --st.classOnline.mut(c);
+        else if (st.classIdle[c]) { --st.classIdle.mut(c); l.disconnect(); }
+        else if (st.classTripped[c]) { --st.classTripped.mut(c); l.disconnect(); tripped = true; }
+        else return false;
+        insertLoad(l);
+        if (tripped) trippedAt(st.loadNames.size() - 1) = 1;
+        *out << "[Class] Materialized " << name << "\n";
+        changed();
+        return true;
+    }
+
+    struct ClassCounts {
+        uint32_t online = 0, idle = 0, tripped = 0;
+    };
+    bool classCounts(const std::string& name, ClassCounts& counts) const {
+        const NameIndex::Ref* ref = st.classIndex.find(name);
+        if (!ref) return false;
+        counts = {st.classOnline[ref->index], st.classIdle[ref->index], st.classTripped[ref->index]};
+        return true;
+    }
+
+    // -------------------
+    // Demand Response
+    // -------------------
+    // An enrolled load is called on, in price order, before any load is shed.
+    // window 0 makes it curtailable by `share` of its demand; a window makes
+    // it shiftable, deferring all its demand for up to that many cycles.
+    // budgetKWc caps the energy it may leave unserved, or owe at once.
+    bool enroll(size_t load, float share, float price, float budgetKWc, uint32_t window) {
+        if (load >= st.loadNames.size() || st.loadEnrolment[load] != GridState::kNotEnrolled) return false;
+        if (window) share = 1.0f;
+        if (!(share > 0 && share <= 1) || budgetKWc < 0) return false;
+        st.loadEnrolment.mut(load) = static_cast<uint32_t>(st.drLoad.size());
+        st.drLoad.push_back(static_cast<uint32_t>(load));
+        st.drShare.push_back(share);
+        st.drPrice.push_back(price);
+        st.drBudget.push_back(budgetKWc);
+        st.drUsed.push_back(0.0f);
+        st.drWindow.push_back(window);
+        st.drOwedSince.push_back(0);
+        bids.invalidate();
+        changed();
+        return true;
+    }
+
+    // Energy a load has curtailed so far, or owes if it shifts; -1 if not enrolled
+    float responseUsed(size_t load) const {
+        if (load >= st.loadNames.size() || st.loadEnrolment[load] == GridState::kNotEnrolled) return -1;
+        return st.drUsed[st.loadEnrolment[load]];
+    }
+
+    void showResponse() {
+        double offered = 0, curtailed = 0, owed = 0;
+        uint32_t debtors = 0;
+        for (uint32_t e = 0; e < st.drLoad.size(); ++e) {
+            offered += BidCurve::offer(st, e);
+            if (!st.drWindow[e]) {
+                curtailed += st.drUsed[e];
+            } else if (st.drUsed[e] > 0) {
+                owed += st.drUsed[e];
+                ++debtors;
+            }
+        }
+        *out << "[Response] " << st.drLoad.size() << " enrolled, " << offered << "kW on offer, " << curtailed
+             << " kW-cycles curtailed, " << owed << " owed by " << debtors << " shifted load(s)\n";
+    }
+
+    // -------------------
+    // Forecasting
+    // -------------------
+    // Smoothing starts with the next cycle. alpha weighs new observations of
+    // the level, beta those of the trend; both in (0, 1]. A grid that was
+    // steady without a forecaster is not steady with one.
+    void enableForecast(float alpha, float beta) {
+        forecast = std::make_unique<DemandForecast>(alpha, beta);
+        changed();
+    }
+    const DemandForecast* getForecast() const { return forecast.get(); }
+
+    void showForecast(uint32_t cycles) {
+        if (!forecast) return;
+        *out << "[Forecast] +" << cycles << " cycles: demand " << forecast->demandAhead(cycles) << "kW, solar "
+             << forecast->solarAhead(cycles) << "kW\n";
+        for (size_t n = 0; n < st.nodeNames.size(); ++n)
+            *out << "[Forecast]   " << st.nodeNames[n] << ": " << forecast->nodeAhead(n, cycles) << "kW\n";
+    }
+
+    // -------------------
+    // Look-ahead Dispatch
+    // -------------------
+    // Plans ramped sources and storage over `horizon` cycles with an LP each
+    // cycle, using the forecast when one is enabled. A solve that overruns
+    // budgetMs falls back to the greedy rule for that cycle. Horizon 0 is greedy.
+    void enableMpc(uint32_t horizon, double budgetMs) {
+        mpcHorizon = horizon;
+        mpcBudgetMs = budgetMs;
+    }
+    void reportDispatch(std::ostream& os) const {
+        if (!mpcSolves) return;
+        os << "[MPC] " << mpcSolves << " horizon solves, " << mpcFallbacks << " fell back to greedy, "
+           << mpcSolveMs / static_cast<double>(mpcSolves) << "ms average\n";
+    }
+
+    // -------------------
+    // Topology
+    // -------------------
+    // A node with parent "-" is a substation; below it come feeders, then
+    // transformers. ratingKW > 0 makes balancing shed inside the subtree
+    // whenever it draws more.
+    bool addNode(const std::string& name, const std::string& parentName, float ratingKW) {
+        uint32_t parent = GridState::kNoNode;
+        if (parentName != "-") {
+            const NameIndex::Ref* ref = st.nodeIndex.find(parentName);
+            if (!ref) return false;
+            parent = ref->index;
+        }
+        if (st.nodeIndex.find(name)) return false;
+        st.nodeIndex.insert(name, {false, static_cast<uint32_t>(st.nodeNames.size())});
+        st.nodeNames.push_back(name);
+        st.nodeParent.push_back(parent);
+        st.nodeRating.push_back(std::max(0.0f, ratingKW));
+        tree.invalidate();
+        changed();
+        return true;
+    }
+
+    // Hangs a load or source off a node; a component sits under one node at a time
+    bool attach(const std::string& component, const std::string& nodeName) {
+        const NameIndex::Ref* ref = st.index.find(component);
+        const NameIndex::Ref* node = st.nodeIndex.find(nodeName);
+        if (!ref || !node) return false;
+        if (ref->isSource) st.sourceNode.mut(ref->index) = node->index;
+        else st.loadNode.mut(ref->index) = node->index;
+        tree.invalidate();
+        changed();
+        return true;
+    }
+
+    // Subtree totals in O(depth) after a local change; false for an unknown node
+    bool nodeTotals(const std::string& name, AggregationTree::Totals& totals) {
+        const NameIndex::Ref* ref = st.nodeIndex.find(name);
+        if (!ref) return false;
+        totals = builtTree().query(ref->index, st, sourceContribution);
+        return true;
+    }
+
+    void showTopology() {
+        static const char* const levels[] = {"Substation", "Feeder", "Transformer"};
+        AggregationTree& t = builtTree();
+        *out << "\n[Topology]\n";
+        std::vector<uint32_t> depth(st.nodeNames.size(), 0);
+        std::vector<uint32_t> stack;  // Depth-first, so each node prints under its parent
+        for (size_t i = st.nodeNames.size(); i-- > 0;)
+            if (st.nodeParent[i] == GridState::kNoNode) stack.push_back(static_cast<uint32_t>(i));
+        while (!stack.empty()) {
+            uint32_t n = stack.back();
+            stack.pop_back();
+            const AggregationTree::Totals& tot = t.query(n, st, sourceContribution);
+            *out << std::string(2 * depth[n], ' ') << (depth[n] < 3 ? levels[depth[n]] : "Node") << " " << st.nodeNames[n]
+                 << ": demand " << tot.demand << "kW, generation " << tot.generation << "kW, loads " << tot.loads
+                 << ", shed " << tot.shed;
+            if (st.nodeRating[n] > 0) *out << ", rating " << st.nodeRating[n] << "kW";
+            *out << "\n";
+            const std::vector<uint32_t>& kids = t.childrenOf(n);
+            for (auto k = kids.rbegin(); k != kids.rend(); ++k) {
+                depth[*k] = depth[n] + 1;
+                stack.push_back(*k);
+            }
+        }
+    }
+
+    void showBreakers() const {
+        std::vector<Breaker> all;
+        all.reserve(st.sources.size() + st.loadNames.size());
+        for (size_t i = 0; i < st.sources.size(); ++i) {
+            all.emplace_back(st.sources[i]->getName());
+            if (st.sourceTripped[i]) all.back().trip();
+        }
+        for (size_t i = 0; i < st.loadNames.size(); ++i) {
+            all.emplace_back(st.loadNames[i]);
+            if (st.loadTripped[i]) all.back().trip();
+        }
+        std::stable_sort(all.begin(), all.end(), [](const Breaker& a, const Breaker& b) { return a.getId() < b.getId(); });
+        *out << "\n[Breaker Status]\n";
+        for (const auto& b : all)
+            *out << b.getId() << ": " << (b.isTripped() ? "TRIPPED" : "OK") << "\n";
+    }
+
+    // Returns loadCount() when no load has that name
+    size_t findLoad(const std::string& name) const {
+        const NameIndex::Ref* ref = findLoadRef(name);
+        return ref ? ref->index : st.loadNames.size();
+    }
+    bool isTripped(const std::string& name) const {
+        const NameIndex::Ref* ref = st.index.find(name);
+        if (!ref) {
+            ref = st.classIndex.find(name);
+            return ref && st.classTripped[ref->index] > 0;
+        }
+        return ref->isSource ? st.sourceTripped[ref->index] != 0 : st.loadTripped[ref->index] != 0;
+    }
+    bool hasFault(const std::string& name) const { return st.faults->count(name) != 0; }
+    // Output of a dispatchable source, or -1 if there is none by that name
+    float sourceOutput(const std::string& name) const {
+        const NameIndex::Ref* ref = st.index.find(name);
+        const PowerSource* ps = ref && ref->isSource ? dynamic_cast<const PowerSource*>(st.sources[ref->index].get()) : nullptr;
+        return ps ? ps->getPowerOutput() : -1.0f;
+    }
+    bool setSourceOutput(const std::string& name, float kW) {
+        const NameIndex::Ref* ref = st.index.find(name);
+        if (!ref || !ref->isSource || !dynamic_cast<const PowerSource*>(st.sources[ref->index].get())) return false;
+        static_cast<PowerSource&>(mutableSource(ref->index)).setPowerOutput(kW);
+        changed();
+        return true;
+    }
+    size_t loadCount() const { return st.loadNames.size(); }
+    const std::string& loadName(size_t i) const { return st.loadNames[i]; }
+    Load getLoad(size_t i) const {
+        Load l(st.loadNames[i], st.loadDemand[i], st.loadPriority[i]);
+        if (!st.loadConnected[i]) l.disconnect();
+        return l;
+    }
+    uint64_t getCycle() const { return st.cycle; }
+    float getTotalPower() const { return st.last.power; }
+    float getTotalDemand() const { return st.last.demand; }
+    const CycleStats& getLastStats() const { return st.last; }
+
+    // Scales every load's demand, e.g. for load growth studies
+    void scaleDemand(float factor) {
+        for (size_t i = 0; i < st.loadDemand.size(); ++i)
+            demandAt(i) *= factor;
+        changed();
+    }
+};
+
+#ifdef SMARTGRID_COROUTINES
+// -------------------------
+// Behavior Library: Ramps, reclosers and inrush as coroutines
+// -------------------------
+// Moves a dispatchable source to targetKW in equal steps, one per cycle
+inline Behavior rampSource(GridManager& gm, std::string name, float targetKW, uint32_t cycles) {
+    const float start = gm.sourceOutput(name);
+    if (start < 0) co_return;
+    cycles = std::max(1u, cycles);
+    for (uint32_t k = 1; k <= cycles; ++k) {
+        float kW = start + (targetKW - start) * static_cast<float>(k) / static_cast<float>(cycles);
+        gm.setSourceOutput(name, kW);
+        gm.output() << "[Behavior] Ramp " << name << ": " << kW << "kW\n";
+        if (k < cycles) co_await sleepCycles(1);
+    }
+}
+
+// Recloses a tripped breaker `delay` cycles after it trips. A shot is spent
+// when a fault is still present or the breaker trips again within `delay`
+// cycles of reclosing; after `attempts` shots the recloser locks out.
+inline Behavior recloser(GridManager& gm, std::string name, uint32_t delay, uint32_t attempts) {
+    uint32_t shots = 0;
+    for (;;) {
+        while (!gm.isTripped(name))
+            co_await sleepCycles(1);
+        if (shots == attempts) {
+            gm.output() << "[Behavior] Recloser " << name << " locked out after " << shots << " shots\n";
+            co_return;
+        }
+        co_await sleepCycles(delay);
+        ++shots;
+        if (gm.hasFault(name)) {
+            gm.output() << "[Behavior] Recloser " << name << ": fault persists (shot " << shots << ")\n";
+            continue;
+        }
+        gm.requestBreaker(name, false);  // Applied later this cycle, before balancing
+        gm.output() << "[Behavior] Recloser " << name << ": reclosing (shot " << shots << ")\n";
+        co_await sleepCycles(delay);
+        if (!gm.isTripped(name)) shots = 0;  // Held: the next trip starts a fresh sequence
+    }
+}
+
+// Whenever the load comes back on it draws factor x its rated demand, decaying
+// linearly to rated over `cycles` cycles. Runs for the life of the grid.
+inline Behavior inrushLoad(GridManager& gm, std::string name, float factor, uint32_t cycles) {
+    const size_t i = gm.findLoad(name);
+    if (i >= gm.loadCount()) co_return;
+    const float rated = gm.getLoad(i).getRawDemand();
+    auto energized = [&gm, &name, i]() { return gm.getLoad(i).isConnected() && !gm.isTripped(name); };
+    bool was = energized();
+    for (;;) {
+        co_await sleepCycles(1);
+        bool now = energized();
+        if (now && !was) {
+            gm.output() << "[Behavior] Inrush " << name << ": " << rated * factor << "kW\n";
+            for (uint32_t k = 0; k < cycles && now; ++k) {
+                gm.setLoadDemand(i, rated * (factor - (factor - 1.0f) * static_cast<float>(k) / static_cast<float>(cycles)));
+                co_await sleepCycles(1);
+                now = energized();
+            }
+            gm.setLoadDemand(i, rated);
+        }
+        was = now;
+    }
+}
+#endif
+
+// -------------------------
+// Operator Overloading
+// -------------------------
+std::ostream& operator<<(std::ostream& os, const Load& load) {
+    os << "[Load] " << load.getName() << ": " << load.getRawDemand() << "kW, Priority: "
+       << load.getPriority() << ", Connected: " << (load.isConnected() ? "Yes" : "No");
+    return os;
+}
+
+std::ostream& operator<<(std::ostream& os, const PowerSource& source) {
+    os << "[Source] " << source.getName() << ": " << source.getPowerOutput() << "kW";
+    return os;
+}
+
+// -------------------------
+// ModbusServer Class: Modbus TCP slave exposing the grid as RTU registers
+// -------------------------
+// Address i refers to component i of the GridSnapshot (sources, then loads).
+//   Coils             (FC1/5/15): breaker tripped; writing 1 trips, 0 resets
+//   Discrete inputs   (FC2)     : component connected
+//   Input registers   (FC4)     : live power flow in 0.1 kW
+//   Holding registers (FC3)     : rating (sources) or demand (loads) in 0.1 kW
+// The server thread only reads a published register image, so polling load
+// never reaches simulate(); coil writes are queued on the GridManager. Two
+// images alternate: the one the server is not reading is refreshed in place,
+// and names are copied only after a topology change.
+class ModbusServer : public GridObserver {
+    struct RegisterImage {
+        uint64_t topology = 0;  // Topology the names were copied from
+        std::vector<std::string> names;
+        std::vector<uint8_t> coils;
+        std::vector<uint8_t> discreteInputs;
+        std::vector<uint16_t> inputRegisters;
+        std::vector<uint16_t> holdingRegisters;
+    };
+    struct Client {
+        int fd;
+        std::string in;
+        std::string out;
+    };
+
+    GridManager& grid;
+    uint16_t port;
+    int listenFd;
+    std::thread worker;
+    std::atomic<bool> running;
+    std::mutex imageMutex;
+    std::shared_ptr<RegisterImage> image;
+    std::shared_ptr<RegisterImage> spare;  // Previous image; simulation thread only
+    uint64_t topology = 0;                 // Bumped on every snapshot with new names
+
+    static uint16_t toRegister(float kW) {
+        float scaled = kW * 10.0f;
+        if (scaled <= 0.0f) return 0;
+        if (scaled >= 65535.0f) return 65535;
+        return static_cast<uint16_t>(scaled + 0.5f);
+    }
+    static uint16_t readU16(const std::string& buf, size_t pos) {
+        return static_cast<uint16_t>((static_cast<uint8_t>(buf[pos]) << 8) | static_cast<uint8_t>(buf[pos + 1]));
+    }
+    static void writeU16(std::string& buf, uint16_t v) {
+        buf.push_back(static_cast<char>(v >> 8));
+        buf.push_back(static_cast<char>(v & 0xFF));
+    }
+    static void setNonBlocking(int fd) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    std::shared_ptr<const RegisterImage> currentImage() {
+        std::lock_guard<std::mutex> lock(imageMutex);
+        return image;
+    }
+
+    static std::string exception(uint8_t function, uint8_t code) {
+        std::string pdu;
+        pdu.push_back(static_cast<char>(function | 0x80));
+        pdu.push_back(static_cast<char>(code));
+        return pdu;
+    }
+
+    static std::string readBits(uint8_t function, const std::vector<uint8_t>& bits, uint16_t start, uint16_t count) {
+        if (count < 1 || count > 2000) return exception(function, 3);
+        if (static_cast<size_t>(start) + count > bits.size()) return exception(function, 2);
+        std::string pdu;
+        pdu.push_back(static_cast<char>(function));
+        pdu.push_back(static_cast<char>((count + 7) / 8));
+        for (uint16_t i = 0; i < count; i += 8) {
+            uint8_t byte = 0;
+            for (uint16_t b = 0; b < 8 && i + b < count; ++b)
+                if (bits[start + i + b]) byte |= static_cast<uint8_t>(1u << b);
+            pdu.push_back(static_cast<char>(byte));
+        }
+        return pdu;
+    }
+
+    static std::string readRegisters(uint8_t function, const std::vector<uint16_t>& regs, uint16_t start, uint16_t count) {
+        if (count < 1 || count > 125) return exception(function, 3);
+        if (static_cast<size_t>(start) + count > regs.size()) return exception(function, 2);
+        std::string pdu;
+        pdu.push_back(static_cast<char>(function));
+        pdu.push_back(static_cast<char>(count * 2));
+        for (uint16_t i = 0; i < count; ++i)
+            writeU16(pdu, regs[start + i]);
+        return pdu;
+    }
+
+    // Handles one request PDU (function code + data) against the given image
+    std::string handlePdu(const std::string& req, const RegisterImage& img) {
+        uint8_t function = static_cast<uint8_t>(req[0]);
+        if (req.size() < 5) return exception(function, 3);
+        uint16_t start = readU16(req, 1);
+        uint16_t value = readU16(req, 3);
+        switch (function) {
+        case 1: return readBits(function, img.coils, start, value);
+        case 2: return readBits(function, img.discreteInputs, start, value);
+        case 3: return readRegisters(function, img.holdingRegisters, start, value);
+        case 4: return readRegisters(function, img.inputRegisters, start, value);
+        case 5: {
+            if (value != 0xFF00 && value != 0x0000) return exception(function, 3);
+            if (start >= img.names.size()) return exception(function, 2);
+            grid.requestBreaker(img.names[start], value == 0xFF00);
+            return req.substr(0, 5);  // Normal response echoes the request
+        }
+        case 15: {
+            if (req.size() < 6) return exception(function, 3);
+            uint8_t byteCount = static_cast<uint8_t>(req[5]);
+            if (value < 1 || value > 1968 || byteCount != (value + 7) / 8 || req.size() < 6u + byteCount)
+                return exception(function, 3);
+            if (static_cast<size_t>(start) + value > img.names.size()) return exception(function, 2);
+            for (uint16_t i = 0; i < value; ++i) {
+                bool bit = (static_cast<uint8_t>(req[6 + i / 8]) >> (i % 8)) & 1;
+                grid.requestBreaker(img.names[start + i], bit);
+            }
+            return req.substr(0, 5);
+        }
+        case 6:
+        case 16:
+            return exception(function, 2);  // Ratings are read-only; control goes through coils
+        default:
+            return exception(function, 1);
+        }
+    }
+
+    // Parses every complete MBAP frame in the client's buffer. Returns false on protocol error.
+    bool processFrames(Client& c, const RegisterImage& img) {
+        size_t pos = 0;
+        while (c.in.size() - pos >= 7) {
+            uint16_t transaction = readU16(c.in, pos);
+            uint16_t protocol = readU16(c.in, pos + 2);
+            uint16_t length = readU16(c.in, pos + 4);
+            if (protocol != 0 || length < 2 || length > 254) return false;
+            if (c.in.size() - pos < 6u + length) break;
+            uint8_t unit = static_cast<uint8_t>(c.in[pos + 6]);
+            std::string pdu = handlePdu(c.in.substr(pos + 7, length - 1u), img);
+            writeU16(c.out, transaction);
+            writeU16(c.out, 0);
+            writeU16(c.out, static_cast<uint16_t>(pdu.size() + 1));
+            c.out.push_back(static_cast<char>(unit));
+            c.out += pdu;
+            pos += 6u + length;
+        }
+        c.in.erase(0, pos);
+        return true;
+    }
+
+    bool flush(Client& c) {
+        TraceSpan span("modbus-flush", "io");
+        while (!c.out.empty()) {
+#ifdef MSG_NOSIGNAL
+            ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+#else
+            ssize_t n = ::send(c.fd, c.out.data(), c.out.size(), 0);
+#endif
+            if (n > 0) c.out.erase(0, static_cast<size_t>(n));
+            else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            else if (n < 0 && errno == EINTR) continue;
+            else return false;
+        }
+        return true;
+    }
+
+    void acceptClients(std::vector<Client>& clients) {
+        for (;;) {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) return;
+            setNonBlocking(fd);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            clients.push_back({fd, std::string(), std::string()});
+        }
+    }
+
+    void serve() {
+        std::vector<Client> clients;
+        std::vector<pollfd> fds;
+        char buf[4096];
+        Tracer::instance().setThreadName("modbus");
+        while (running.load(std::memory_order_relaxed)) {
+            fds.clear();
+            fds.push_back({listenFd, POLLIN, 0});
+            for (const auto& c : clients)
+                fds.push_back({c.fd, static_cast<short>(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
+            int ready = ::poll(fds.data(), static_cast<nfds_t>(fds.size()), 100);
+            if (ready <= 0) continue;
+
+            TraceSpan span("modbus-requests", "worker");
+            std::shared_ptr<const RegisterImage> img = currentImage();
+            std::vector<bool> dead(clients.size(), false);
+            for (size_t i = 0; i < clients.size(); ++i) {
+                short ev = fds[i + 1].revents;
+                if (!ev) continue;
+                Client& c = clients[i];
+                if (ev & (POLLERR | POLLHUP | POLLNVAL)) { dead[i] = true; continue; }
+                if (ev & POLLIN) {
+                    ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+                    if (n <= 0) { dead[i] = true; continue; }
+                    c.in.append(buf, static_cast<size_t>(n));
+                    if (!processFrames(c, *img)) { dead[i] = true; continue; }
+                }
+                if (!flush(c)) dead[i] = true;
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < clients.size(); ++i) {
+                if (dead[i]) ::close(clients[i].fd);
+                else clients[kept++] = std::move(clients[i]);
+            }
+            clients.resize(kept);
+            if (fds[0].revents & POLLIN) acceptClients(clients);
+            std::lock_guard<std::mutex> lock(imageMutex);
+            img.reset();  // Lets onGridUpdate() refresh this image in place
+        }
+        for (const auto& c : clients)
+            ::close(c.fd);
+    }
+
+public:
+    ModbusServer(GridManager& g, uint16_t p)
+        : grid(g), port(p), listenFd(-1), running(false), image(std::make_shared<RegisterImage>()) {}
+    ~ModbusServer() { stop(); }
+
+    bool start() {
+        // Thousands of SCADA pollers each hold a descriptor
+        rlimit lim;
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+            lim.rlim_cur = lim.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &lim);
+        }
+        listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) return false;
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            ::listen(listenFd, SOMAXCONN) < 0) {
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        setNonBlocking(listenFd);
+        running = true;
+        worker = std::thread(&ModbusServer::serve, this);
+        std::cout << "[Modbus] Listening on 127.0.0.1:" << port << "\n";
+        return true;
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        worker.join();
+        ::close(listenFd);
+        listenFd = -1;
+    }
+
+    // Refreshes the spare image and swaps it in; runs on the simulation thread
+    void onGridUpdate(const GridSnapshot& snapshot) override {
+        if (snapshot.topologyChanged) ++topology;
+        std::shared_ptr<RegisterImage> img = std::move(spare);
+        {
+            // The server drops its reference under the lock, so a sole owner
+            // seen here means its reads of the image are over
+            std::lock_guard<std::mutex> lock(imageMutex);
+            if (img.use_count() != 1) img.reset();
+        }
+        if (!img) img = std::make_shared<RegisterImage>();  // Still being served from; leave it
+        const size_t n = snapshot.components.size();
+        if (img->topology != topology) {
+            img->names.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                img->names[i] = snapshot.components[i].name;
+            img->topology = topology;
         }
+        img->coils.resize(n);
+        img->discreteInputs.resize(n);
+        img->inputRegisters.resize(n);
+        img->holdingRegisters.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            const GridSnapshot::Entry& e = snapshot.components[i];
+            img->coils[i] = e.tripped ? 1 : 0;
+            img->discreteInputs[i] = e.connected ? 1 : 0;
+            img->inputRegisters[i] = toRegister(e.flow);
+            img->holdingRegisters[i] = toRegister(e.rating);
+        }
+        {
+            std::lock_guard<std::mutex> lock(imageMutex);
+            image.swap(img);
+        }
+        spare = std::move(img);
     }
 };
 
 // -------------------------
-// Load Class (not derived from base, supports simulation and disconnection)
+// ScenarioScript: Scenario language compiled to bytecode
 // -------------------------
-class Load {
-    std::string name;
-    float demand;
-    bool connected;
-    int priority;
+// One statement per line, '#' starts a comment:
+//   step [n]                      run n simulation cycles (default 1), fast-forwarding steady state
+//   repeat <n> ... end            loop, may be nested
+//   fault <name> / resolve <name> inject or resolve a fault at a breaker
+//   disconnect <load> / reconnect <load>
+//   set <load> <kW>               set a load's demand
+//   ramp <load> <deltaKW>         change a load's demand by delta
+//   add_load <name> <kW> <priority>
+//   add_source <name> <kW> <type> type as in menu option 8
+//   assert power|demand <op> <kW> op is one of < <= == >= > !=
+//   assert connected|disconnected|tripped <name>
+//   node <name> <parent|-> [ratingKW]        add a substation ('-'), feeder or transformer
+//   attach <component> <node>    hang a load or source off a topology node
+//   assert node <name> demand|generation|shed <op> <value>
+//   add_class <name> <kW> <priority> <count>  <count> identical loads held as one class
+//   assert class <name> online|idle|tripped <op> <count>
+//   topology                      print the tree with subtree totals
+//   forecast <k>                  print the k-cycle-ahead forecast (needs --forecast)
+//   add_ramped <name> <maxKW> <rampKW> <costPerKW>   dispatchable unit with a ramp limit
+//   add_storage <name> <capacity> <rateKW> [stored]  battery, energy in kW-cycles
+//   print <text>
+//   begin ... commit              stage the mutations in between as one transaction
+//   undo / redo                   revert or reapply the last fault, resolve, disconnect,
+//                                 reconnect, add_load or add_source; any step ends the history
+//   behavior ramp <source> <kW> <cycles>        (C++20 builds) ramp a source's output
+//   behavior recloser <name> <delay> <shots>    reclose a breaker after a trip
+//   behavior inrush <load> <factor> <cycles>    startup surge on every reconnection
+// Names are interned at compile time; the interpreter resolves each name to a
+// load index once and caches it, so a running script never parses text. A
+// name "<class>:<k>" that is not a load yet materializes that class instance.
+class ScenarioScript {
+    enum Op : uint8_t {
+        Step, LoopInit, LoopBack, Jump, Fault, Resolve, Disconnect, Reconnect, Ramp, SetDemand,
+        AddLoad, AddSource, AssertPower, AssertDemand, AssertConnected, AssertDisconnected, AssertTripped, Print,
+        Begin, Commit, SpawnBehavior, AddNode, Attach, AssertNode, ShowTopology, AddClass, AssertClass,
+        ShowForecast, AddRamped, AddStorage, Enroll, AssertResponse, ShowResponse, Undo, Redo,
+        Operand  // Extra operands (a, b) of the preceding instruction, never executed
+    };
+    enum BehaviorKind : uint8_t { RampBehavior, RecloserBehavior, InrushBehavior };
+    enum Cmp : uint8_t { Lt, Le, Eq, Ge, Gt, Ne };
+
+    struct Instr {
+        uint8_t op;
+        uint8_t flag;    // Comparison or source type
+        uint16_t small;  // Loop slot, load priority, behavior cycles, second name or node quantity
+        uint32_t a;      // Count, jump target or string index
+        float b;         // kW operand
+    };
+    static_assert(sizeof(Instr) == 12, "Instr must stay 12 bytes");
+
+    std::vector<Instr> code;
+    std::vector<uint32_t> lines;         // Source line of each instruction, for diagnostics
+    std::vector<std::string> strings;    // Interned names and print text
+    uint16_t maxDepth = 0;
+    bool history = false;  // Uses undo/redo, so operator statements are checkpointed
+
+    uint32_t intern(const std::string& str) {
+        for (size_t i = 0; i < strings.size(); ++i)
+            if (strings[i] == str) return static_cast<uint32_t>(i);
+        strings.push_back(str);
+        return static_cast<uint32_t>(strings.size() - 1);
+    }
+
+    void emit(uint32_t line, uint8_t op, uint32_t a = 0, float b = 0, uint8_t flag = 0, uint16_t small = 0) {
+        code.push_back({op, flag, small, a, b});
+        lines.push_back(line);
+    }
+
+    static bool parseCmp(const std::string& s, uint8_t& out) {
+        static const char* const ops[] = {"<", "<=", "==", ">=", ">", "!="};
+        for (uint8_t i = 0; i < 6; ++i)
+            if (s == ops[i]) { out = i; return true; }
+        return false;
+    }
+
+    static bool compare(float lhs, uint8_t cmp, float rhs) {
+        switch (cmp) {
+        case Lt: return lhs < rhs;
+        case Le: return lhs <= rhs;
+        case Eq: return lhs == rhs;
+        case Ge: return lhs >= rhs;
+        case Gt: return lhs > rhs;
+        default: return lhs != rhs;
+        }
+    }
+
 public:
-    Load(const std::string& n, float d, int p = 5) : name(n), demand(d), connected(true), priority(p) {}
-    std::string getName() const { return name; }
-    float getRawDemand() const { return demand; }
-    bool isConnected() const { return connected; }
-    int getPriority() const { return priority; }
-    void disconnect() { connected = false; }
-    void reconnect() { connected = true; }
-    void simulate() const {
-        std::cout << "[Load] " << name << ": " << demand << "kW, Priority: " << priority
-                  << ", Connected: " << (connected ? "Yes" : "No") << "\n";
+    // Compiles the whole script; on failure `error` names the offending line
+    bool compile(std::istream& src, std::string& error) {
+        code.clear(); lines.clear(); strings.clear(); maxDepth = 0; history = false;
+        std::vector<size_t> openLoops;  // Index of each open LoopInit
+        uint32_t openBegin = 0;         // Line of an unfinished 'begin', or 0
+        std::string text;
+        uint32_t lineNo = 0;
+        while (std::getline(src, text)) {
+            ++lineNo;
+            size_t hash = text.find('#');
+            if (hash != std::string::npos) text.erase(hash);
+            std::istringstream ss(text);
+            std::string cmd, name, what;
+            if (!(ss >> cmd)) continue;
+            float kW = 0;
+            long n = 1;
+            bool ok = true;
+            if (cmd == "begin" || cmd == "commit") {
+                ok = (cmd == "begin") == (openBegin == 0);
+                openBegin = cmd == "begin" ? lineNo : 0;
+                if (ok) emit(lineNo, cmd == "begin" ? Begin : Commit);
+            } else if (cmd == "step") {
+                if (!(ss >> n)) n = 1;
+                ok = n > 0 && openBegin == 0;
+                if (ok) emit(lineNo, Step, static_cast<uint32_t>(n));
+            } else if (cmd == "repeat") {
+                ok = static_cast<bool>(ss >> n) && n >= 0 && openLoops.size() < 65535;
+                if (ok) {
+                    uint16_t slot = static_cast<uint16_t>(openLoops.size());
+                    maxDepth = std::max<uint16_t>(maxDepth, static_cast<uint16_t>(slot + 1));
+                    openLoops.push_back(code.size());
+                    emit(lineNo, LoopInit, static_cast<uint32_t>(n), 0, 0, slot);
+                }
+            } else if (cmd == "end") {
+                ok = !openLoops.empty();
+                if (ok) {
+                    size_t init = openLoops.back();
+                    openLoops.pop_back();
+                    emit(lineNo, LoopBack, static_cast<uint32_t>(init + 1), 0, 0, code[init].small);
+                    if (code[init].a == 0) {
+                        // Zero-trip loop: turn LoopInit into a jump past the body
+                        code[init].op = Jump;
+                        code[init].a = static_cast<uint32_t>(code.size());
+                    }
+                }
+            } else if (cmd == "fault" || cmd == "resolve" || cmd == "disconnect" || cmd == "reconnect") {
+                ok = static_cast<bool>(ss >> name);
+                uint8_t op = cmd == "fault" ? Fault : cmd == "resolve" ? Resolve : cmd == "disconnect" ? Disconnect : Reconnect;
+                if (ok) emit(lineNo, op, intern(name));
+            } else if (cmd == "set" || cmd == "ramp") {
+                ok = static_cast<bool>(ss >> name >> kW);
+                if (ok) emit(lineNo, cmd == "set" ? SetDemand : Ramp, intern(name), kW);
+            } else if (cmd == "add_load") {
+                int priority = 5;
+                ok = static_cast<bool>(ss >> name >> kW >> priority) && priority >= 0 && priority <= 65535;
+                if (ok) emit(lineNo, AddLoad, intern(name), kW, 0, static_cast<uint16_t>(priority));
+            } else if (cmd == "add_source") {
+                int type = 0;
+                ok = static_cast<bool>(ss >> name >> kW >> type) && type >= 0 && type <= 255;
+                if (ok) emit(lineNo, AddSource, intern(name), kW, static_cast<uint8_t>(type));
+            } else if (cmd == "assert") {
+                ok = static_cast<bool>(ss >> what);
+                uint8_t cmp = 0;
+                if (ok && (what == "power" || what == "demand")) {
+                    std::string op;
+                    ok = static_cast<bool>(ss >> op >> kW) && parseCmp(op, cmp);
+                    if (ok) emit(lineNo, what == "power" ? AssertPower : AssertDemand, 0, kW, cmp);
+                } else if (ok && what == "node") {
+                    std::string quantity, op;
+                    ok = static_cast<bool>(ss >> name >> quantity >> op >> kW) && parseCmp(op, cmp) &&
+                         (quantity == "demand" || quantity == "generation" || quantity == "shed");
+                    uint16_t q = quantity == "demand" ? 0 : quantity == "generation" ? 1 : 2;
+                    if (ok) emit(lineNo, AssertNode, intern(name), kW, cmp, q);
+                } else if (ok && what == "class") {
+                    std::string quantity, op;
+                    ok = static_cast<bool>(ss >> name >> quantity >> op >> kW) && parseCmp(op, cmp) &&
+                         (quantity == "online" || quantity == "idle" || quantity == "tripped");
+                    uint16_t q = quantity == "online" ? 0 : quantity == "idle" ? 1 : 2;
+                    if (ok) emit(lineNo, AssertClass, intern(name), kW, cmp, q);
+                } else if (ok && what == "response") {
+                    std::string op;
+                    ok = static_cast<bool>(ss >> name >> op >> kW) && parseCmp(op, cmp);
+                    if (ok) emit(lineNo, AssertResponse, intern(name), kW, cmp);
+                } else if (ok && (what == "connected" || what == "disconnected" || what == "tripped")) {
+                    ok = static_cast<bool>(ss >> name);
+                    uint8_t op = what == "connected" ? AssertConnected : what == "disconnected" ? AssertDisconnected : AssertTripped;
+                    if (ok) emit(lineNo, op, intern(name));
+                } else {
+                    ok = false;
+                }
+            } else if (cmd == "behavior") {
+#ifdef SMARTGRID_COROUTINES
+                long count = 0;
+                ok = static_cast<bool>(ss >> what >> name >> kW >> count) && count >= 0 &&
+                     (what == "ramp" || what == "recloser" || what == "inrush");
+                uint8_t kind = what == "ramp" ? RampBehavior : what == "recloser" ? RecloserBehavior : InrushBehavior;
+                // Cycles go in `small`; for the recloser that is the delay, and the shot count goes in `b`
+                float cycles = kind == RecloserBehavior ? kW : static_cast<float>(count);
+                float value = kind == RecloserBehavior ? static_cast<float>(count) : kW;
+                ok = ok && cycles >= 0 && cycles <= 65535;
+                if (ok) emit(lineNo, SpawnBehavior, intern(name), value, kind, static_cast<uint16_t>(cycles));
+#else
+                error = "line " + std::to_string(lineNo) + ": 'behavior' needs a C++20 build";
+                return false;
+#endif
+            } else if (cmd == "node" || cmd == "attach") {
+                // The second name is interned into `small`, which bounds a script to 65536 names
+                std::string other;
+                ok = static_cast<bool>(ss >> name >> other) && openBegin == 0;
+                if (ok && cmd == "node" && !(ss >> kW)) kW = 0;
+                uint32_t second = ok ? intern(other) : 0;
+                ok = ok && second <= 65535;
+                if (ok) emit(lineNo, cmd == "node" ? AddNode : Attach, intern(name), kW, 0, static_cast<uint16_t>(second));
+            } else if (cmd == "add_class") {
+                int priority = 5;
+                long long count = 0;
+                ok = static_cast<bool>(ss >> name >> kW >> priority >> count) && priority >= 0 && priority <= 65535 &&
+                     count >= 0 && count <= UINT32_MAX && openBegin == 0;
+                if (ok) {
+                    emit(lineNo, AddClass, intern(name), kW, 0, static_cast<uint16_t>(priority));
+                    emit(lineNo, Operand, static_cast<uint32_t>(count));
+                }
+            } else if (cmd == "add_ramped" || cmd == "add_storage") {
+                float second = 0, third = 0;
+                ok = static_cast<bool>(ss >> name >> kW >> second) && openBegin == 0;
+                if (ok && !(ss >> third)) ok = cmd == "add_storage";  // Storage starts empty by default
+                ok = ok && kW >= 0 && second >= 0 && third >= 0;
+                if (ok) {
+                    emit(lineNo, cmd == "add_ramped" ? AddRamped : AddStorage, intern(name), kW);
+                    emit(lineNo, Operand, 0, second);
+                    emit(lineNo, Operand, 0, third);
+                }
+            } else if (cmd == "enroll") {
+                // Curtailable loads give a percentage of demand, shiftable ones a window in cycles
+                float price = 0, budget = 0;
+                ok = static_cast<bool>(ss >> name >> what >> kW >> price >> budget) && openBegin == 0 &&
+                     (what == "curtail" || what == "shift") && kW > 0 && budget >= 0;
+                ok = ok && (what == "curtail" ? kW <= 100 : kW <= UINT32_MAX && kW == std::floor(kW));
+                if (ok) {
+                    emit(lineNo, Enroll, intern(name), kW, what == "shift" ? 1 : 0);
+                    emit(lineNo, Operand, 0, price);
+                    emit(lineNo, Operand, 0, budget);
+                }
+            } else if (cmd == "undo" || cmd == "redo") {
+                ok = openBegin == 0;
+                history = true;
+                if (ok) emit(lineNo, cmd == "undo" ? Undo : Redo);
+            } else if (cmd == "response") {
+                emit(lineNo, ShowResponse);
+            } else if (cmd == "topology") {
+                emit(lineNo, ShowTopology);
+            } else if (cmd == "forecast") {
+                ok = static_cast<bool>(ss >> n) && n > 0 && n <= UINT32_MAX;
+                if (ok) emit(lineNo, ShowForecast, static_cast<uint32_t>(n));
+            } else if (cmd == "print") {
+                std::string rest;
+                std::getline(ss >> std::ws, rest);
+                emit(lineNo, Print, intern(rest));
+            } else {
+                error = "line " + std::to_string(lineNo) + ": unknown statement '" + cmd + "'";
+                return false;
+            }
+            if (!ok) {
+                error = "line " + std::to_string(lineNo) + ": malformed '" + cmd + "'";
+                return false;
+            }
+        }
+        if (openBegin) {
+            error = "line " + std::to_string(openBegin) + ": 'begin' without 'commit'";
+            return false;
+        }
+        if (!openLoops.empty()) {
+            error = "line " + std::to_string(lines[openLoops.back()]) + ": 'repeat' without 'end'";
+            return false;
+        }
+        return true;
+    }
+
+    size_t size() const { return code.size(); }
+
+    // Executes the program against the grid; returns false on a failed assertion or unknown name
+    bool run(GridManager& gm, std::ostream& os) const {
+        const size_t unresolved = static_cast<size_t>(-1);
+        std::vector<size_t> loadIndex(strings.size(), unresolved);
+        std::vector<uint32_t> counters(maxDepth, 0);
+        std::unique_ptr<GridTransaction> tx;  // Open between Begin and Commit
+        auto load = [&](uint32_t s) {
+            if (loadIndex[s] == unresolved) {
+                size_t i = gm.findLoad(strings[s]);
+                if (i >= gm.loadCount() && gm.materialize(strings[s])) i = gm.findLoad(strings[s]);
+                if (i < gm.loadCount()) loadIndex[s] = i;  // Only undo removes loads, and it clears the cache
+            }
+            return loadIndex[s];
+        };
+        auto fail = [&](size_t pc, const std::string& what) {
+            os << "[Script] line " << lines[pc] << ": " << what << "\n";
+            return false;
+        };
+
+        uint64_t executed = 0, cycles = 0, skipped = 0;
+        auto start = std::chrono::steady_clock::now();
+        size_t pc = 0;
+        const size_t end = code.size();
+        while (pc < end) {
+            const Instr& in = code[pc];
+            ++executed;
+            // The statements the menu lets an operator undo (options 2-5, 7 and 8)
+            const char* action = nullptr;
+            if (history && !tx) {
+                switch (in.op) {
+                case Fault: action = "Inject fault"; break;
+                case Resolve: action = "Resolve fault"; break;
+                case Disconnect: action = "Disconnect load"; break;
+                case Reconnect: action = "Reconnect load"; break;
+                case AddLoad: action = "Add new load"; break;
+                case AddSource: action = "Add new source"; break;
+                default: break;
+                }
+            }
+            if (action) gm.checkpoint(action);
+            switch (in.op) {
+            case Step:
+                skipped += in.a - gm.advance(in.a);
+                cycles += in.a;
+                break;
+            case LoopInit:
+                counters[in.small] = in.a;
+                break;
+            case LoopBack:
+                if (--counters[in.small] > 0) { pc = in.a; continue; }
+                break;
+            case Jump:
+                pc = in.a;
+                continue;
+            case Begin:
+                tx.reset(new GridTransaction());
+                break;
+            case Commit: {
+                std::string error;
+                bool committed = gm.commit(*tx, error);
+                tx.reset();
+                if (!committed) return fail(pc, "transaction rejected: " + error);
+                break;
+            }
+            case Fault:
+                if (tx) { tx->injectFault(strings[in.a]); break; }
+                if (!gm.injectFault(strings[in.a])) return fail(pc, "no breaker named " + strings[in.a]);
+                break;
+            case Resolve:
+                if (tx) { tx->resolveFault(strings[in.a]); break; }
+                if (!gm.resolveFault(strings[in.a])) return fail(pc, "no active fault at " + strings[in.a]);
+                break;
+            case Disconnect:
+            case Reconnect:
+            case Ramp:
+            case SetDemand:
+            case AssertConnected:
+            case AssertDisconnected: {
+                if (tx && in.op == Disconnect) { tx->disconnectLoad(strings[in.a]); break; }
+                if (tx && in.op == Reconnect) { tx->reconnectLoad(strings[in.a]); break; }
+                if (tx && in.op == SetDemand) { tx->setLoadDemand(strings[in.a], in.b); break; }
+                size_t i = load(in.a);
+                if (i == unresolved) return fail(pc, "no load named " + strings[in.a]);
+                Load l = gm.getLoad(i);
+                if (in.op == Disconnect) gm.disconnectLoad(i);
+                else if (in.op == Reconnect) gm.reconnectLoad(i);
+                else if (in.op == Ramp && tx) tx->setLoadDemand(strings[in.a], std::max(0.0f, l.getRawDemand() + in.b));
+                else if (in.op == Ramp) gm.setLoadDemand(i, std::max(0.0f, l.getRawDemand() + in.b));
+                else if (in.op == SetDemand) gm.setLoadDemand(i, in.b);
+                else if (l.isConnected() != (in.op == AssertConnected))
+                    return fail(pc, "assertion failed: " + strings[in.a] + (l.isConnected() ? " is connected" : " is disconnected"));
+                break;
+            }
+            case AddLoad:
+                if (tx) tx->addLoad(Load(strings[in.a], in.b, in.small));
+                else gm.addLoad(Load(strings[in.a], in.b, in.small));
+                break;
+            case AddSource: {
+                PowerComponent* src = in.flag == 1 ? new SolarSource(strings[in.a])
+                    : new PowerSource(strings[in.a], in.b, (in.flag == 2 || in.flag == 3));
+                if (tx) tx->addSource(src);
+                else gm.addSource(src);
+                break;
+            }
+            case AssertPower:
+            case AssertDemand: {
+                float actual = in.op == AssertPower ? gm.getTotalPower() : gm.getTotalDemand();
+                if (!compare(actual, in.flag, in.b)) {
+                    std::ostringstream msg;
+                    msg << "assertion failed: " << (in.op == AssertPower ? "power" : "demand") << " is " << actual << "kW";
+                    return fail(pc, msg.str());
+                }
+                break;
+            }
+            case AssertTripped:
+                if (!gm.isTripped(strings[in.a])) return fail(pc, "assertion failed: " + strings[in.a] + " is not tripped");
+                break;
+            case AddNode:
+                if (!gm.addNode(strings[in.a], strings[in.small], in.b))
+                    return fail(pc, "cannot add node " + strings[in.a] + " under " + strings[in.small]);
+                break;
+            case Attach:
+                if (!gm.attach(strings[in.a], strings[in.small]))
+                    return fail(pc, "cannot attach " + strings[in.a] + " to " + strings[in.small]);
+                break;
+            case AssertNode: {
+                static const char* const quantities[] = {"demand", "generation", "shed"};
+                AggregationTree::Totals t;
+                if (!gm.nodeTotals(strings[in.a], t)) return fail(pc, "no node named " + strings[in.a]);
+                float actual = in.small == 0 ? t.demand : in.small == 1 ? t.generation : static_cast<float>(t.shed);
+                if (!compare(actual, in.flag, in.b)) {
+                    std::ostringstream msg;
+                    msg << "assertion failed: " << strings[in.a] << " " << quantities[in.small] << " is " << actual;
+                    return fail(pc, msg.str());
+                }
+                break;
+            }
+            case ShowTopology:
+                gm.showTopology();
+                break;
+            case AddClass:
+                if (!gm.addClass(strings[in.a], in.b, in.small, code[pc + 1].a))
+                    return fail(pc, "cannot add class " + strings[in.a]);
+                ++pc;  // Skip the count operand
+                break;
+            case AssertClass: {
+                static const char* const quantities[] = {"online", "idle", "tripped"};
+                GridManager::ClassCounts counts;
+                if (!gm.classCounts(strings[in.a], counts)) return fail(pc, "no class named " + strings[in.a]);
+                uint32_t actual = in.small == 0 ? counts.online : in.small == 1 ? counts.idle : counts.tripped;
+                if (!compare(static_cast<float>(actual), in.flag, in.b)) {
+                    std::ostringstream msg;
+                    msg << "assertion failed: " << strings[in.a] << " " << quantities[in.small] << " is " << actual;
+                    return fail(pc, msg.str());
+                }
+                break;
+            }
+            case AddRamped:
+            case AddStorage: {
+                const float second = code[pc + 1].b, third = code[pc + 2].b;
+                if (in.op == AddRamped) gm.addSource(new RampedSource(strings[in.a], in.b, second, third));
+                else gm.addSource(new StorageUnit(strings[in.a], in.b, second, third));
+                pc += 2;  // Skip the operands
+                break;
+            }
+            case Enroll: {
+                size_t i = load(in.a);
+                if (i == unresolved) return fail(pc, "no load named " + strings[in.a]);
+                const bool shift = in.flag == 1;
+                if (!gm.enroll(i, shift ? 1.0f : in.b / 100.0f, code[pc + 1].b, code[pc + 2].b, shift ? static_cast<uint32_t>(in.b) : 0))
+                    return fail(pc, strings[in.a] + " is already enrolled");
+                pc += 2;  // Skip the operands
+                break;
+            }
+            case AssertResponse: {
+                size_t i = load(in.a);
+                if (i == unresolved) return fail(pc, "no load named " + strings[in.a]);
+                const float used = gm.responseUsed(i);
+                if (used < 0) return fail(pc, strings[in.a] + " is not enrolled");
+                if (!compare(used, in.flag, in.b)) {
+                    std::ostringstream msg;
+                    msg << "assertion failed: " << strings[in.a] << " response is " << used << " kW-cycles";
+                    return fail(pc, msg.str());
+                }
+                break;
+            }
+            case ShowResponse:
+                gm.showResponse();
+                break;
+            case ShowForecast:
+                if (!gm.getForecast()) return fail(pc, "forecasting is off (run with --forecast)");
+                gm.showForecast(in.a);
+                break;
+            case Operand:
+                break;
+            case Print:
+                os << "[Script] " << strings[in.a] << "\n";
+                break;
+            case Undo:
+            case Redo:
+                if (!(in.op == Undo ? gm.undo() : gm.redo()))
+                    os << "[Script] Nothing to " << (in.op == Undo ? "undo" : "redo") << ".\n";
+                std::fill(loadIndex.begin(), loadIndex.end(), unresolved);  // Undoing add_load removes loads
+                break;
+#ifdef SMARTGRID_COROUTINES
+            case SpawnBehavior:
+                if (in.flag == RampBehavior) gm.spawn(rampSource(gm, strings[in.a], in.b, in.small));
+                else if (in.flag == RecloserBehavior) gm.spawn(recloser(gm, strings[in.a], in.small, static_cast<uint32_t>(in.b)));
+                else gm.spawn(inrushLoad(gm, strings[in.a], in.b, in.small));
+                break;
+#endif
+            }
+            if (action) gm.endAction();
+            ++pc;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        os << "[Script] Completed: " << executed << " instructions, " << cycles << " cycles";
+        if (skipped) os << " (" << skipped << " fast-forwarded)";
+        os << " in " << ms << "ms\n";
+        return true;
     }
 };
 
 // -------------------------
-// GridManager Class: Core controller
+// ParameterSweep: Capacity planning over a grid of parameters
 // -------------------------
-class GridManager {
-    std::vector<PowerComponent*> sources;  // Polymorphism via base class pointers
-    std::vector<Load> loads;
-    std::map<std::string, Breaker> breakers;
-    std::set<std::string> faults;
+// Every job forks the same base GridState, so topology is shared read-only and
+// each job pays only for the chunks it changes. Jobs are stolen from the
+// TaskScheduler's deques by its workers, and each job fills its own row of the
+// columnar results, so workers never lock.
+class ParameterSweep {
 public:
-    ~GridManager() {
-        for (auto src : sources)
-            delete src;  //  Memory management (requirement 5)
-    }
+    struct Spec {
+        std::vector<int> solarUnits{0};   // Extra SolarSource units per job
+        std::vector<float> firmKW{0};     // Extra dispatchable capacity per job
+        std::vector<float> growth{1.0f};  // Load demand multiplier per job
+        uint32_t cycles = 100;
+        unsigned int seed = 1;
 
-    void addSource(PowerComponent* src) {
-        sources.push_back(src);
-        breakers.emplace(src->getName(), Breaker(src->getName()));
-        simulate();
+        // Parses "solar=0,2,4;firm=0,50;growth=1,1.25;cycles=200;seed=7"
+        bool parse(const std::string& text, std::string& error) {
+            std::istringstream fields(text);
+            std::string field;
+            while (std::getline(fields, field, ';')) {
+                size_t eq = field.find('=');
+                if (eq == std::string::npos) { error = "expected key=values in '" + field + "'"; return false; }
+                std::string key = field.substr(0, eq);
+                std::vector<double> values;
+                std::istringstream list(field.substr(eq + 1));
+                std::string item;
+                while (std::getline(list, item, ',')) {
+                    char* end = nullptr;
+                    double v = std::strtod(item.c_str(), &end);
+                    if (item.empty() || *end || v < 0) { error = "bad value '" + item + "' for " + key; return false; }
+                    values.push_back(v);
+                }
+                if (values.empty()) { error = "no values for " + key; return false; }
+                if (key == "solar") { solarUnits.clear(); for (double v : values) solarUnits.push_back(static_cast<int>(v)); }
+                else if (key == "firm") { firmKW.clear(); for (double v : values) firmKW.push_back(static_cast<float>(v)); }
+                else if (key == "growth") { growth.clear(); for (double v : values) growth.push_back(static_cast<float>(v)); }
+                else if (key == "cycles" && values[0] >= 1) cycles = static_cast<uint32_t>(values[0]);
+                else if (key == "seed") seed = static_cast<unsigned int>(values[0]);
+                else { error = "unknown sweep parameter '" + key + "'"; return false; }
+            }
+            return true;
+        }
+
+        size_t jobs() const { return solarUnits.size() * firmKW.size() * growth.size(); }
+    };
+
+    struct Results {
+        std::vector<int> solarUnits;
+        std::vector<float> firmKW, growth;
+        std::vector<uint32_t> p1ShedCycles;  // Cycles in which a priority-1 load was shed
+        std::vector<uint32_t> shedEvents;
+        std::vector<float> servedFraction;   // Energy served / energy requested
+        std::vector<float> minMarginKW;      // Worst generation minus requested demand
+
+        void resize(size_t n) {
+            solarUnits.resize(n); firmKW.resize(n); growth.resize(n);
+            p1ShedCycles.resize(n); shedEvents.resize(n); servedFraction.resize(n); minMarginKW.resize(n);
+        }
+        size_t size() const { return solarUnits.size(); }
+    };
+
+private:
+    GridState base;
+    Spec spec;
+    Results results;
+
+    void runJob(size_t job) {
+        size_t g = job % spec.growth.size();
+        size_t f = (job / spec.growth.size()) % spec.firmKW.size();
+        size_t s = job / (spec.growth.size() * spec.firmKW.size());
+        results.solarUnits[job] = spec.solarUnits[s];
+        results.firmKW[job] = spec.firmKW[f];
+        results.growth[job] = spec.growth[g];
+
+        std::minstd_rand rng(spec.seed + static_cast<unsigned int>(job));
+        threadRng() = &rng;
+        GridManager grid(base);
+        if (spec.growth[g] != 1.0f) grid.scaleDemand(spec.growth[g]);
+        GridTransaction tx;
+        for (int k = 0; k < spec.solarUnits[s]; ++k)
+            tx.addSource(new SolarSource("Sweep-Solar-" + std::to_string(k)));
+        if (spec.firmKW[f] > 0) tx.addSource(new PowerSource("Sweep-Firm", spec.firmKW[f], false));
+
+        uint32_t p1Cycles = 0, shed = 0;
+        double served = 0, requested = 0;
+        float minMargin = std::numeric_limits<float>::max();
+        std::string error;
+        grid.commit(tx, error);  // Applies the job's changes and runs the first cycle
+        for (uint32_t c = 0; c < spec.cycles; ++c) {
+            if (c > 0) grid.simulate();
+            const CycleStats& cs = grid.getLastStats();
+            if (cs.minTripPriority >= 0 && cs.minTripPriority <= 1) ++p1Cycles;
+            shed += cs.trips;
+            served += cs.demand;
+            requested += cs.requested;
+            minMargin = std::min(minMargin, cs.power - cs.requested);
+        }
+        threadRng() = nullptr;
+        results.p1ShedCycles[job] = p1Cycles;
+        results.shedEvents[job] = shed;
+        results.servedFraction[job] = requested > 0 ? static_cast<float>(served / requested) : 1.0f;
+        results.minMarginKW[job] = minMargin;
     }
 
-    void addLoad(const Load& l) {
-        loads.push_back(l);
-        breakers.emplace(l.getName(), Breaker(l.getName()));
+public:
+    ParameterSweep(const GridState& b, const Spec& s) : base(b), spec(s) {}
+
+    const Results& run(TaskScheduler& scheduler) {
+        TraceSpan span("sweep", "worker");
+        results.resize(spec.jobs());
+        scheduler.parallelFor(0, spec.jobs(), 1, [this](size_t first, size_t last) {
+            for (size_t job = first; job < last; ++job) {
+                TraceSpan jobSpan("sweep-job", "worker");
+                runJob(job);
+            }
+        });
+        return results;
     }
 
-    //  Simulation logic using polymorphism
-    void simulate() {
-        std::cout << "\n=== Cycle ===\n[Log] Simulation Start\n";
-        float totalPower = 0, totalDemand = 0;
+    bool writeCsv(const std::string& path) const {
+        std::ofstream csv(path);
+        if (!csv) return false;
+        csv << "solar_units,firm_kw,growth,p1_shed_cycles,shed_events,served_fraction,min_margin_kw\n";
+        for (size_t i = 0; i < results.size(); ++i)
+            csv << results.solarUnits[i] << ',' << results.firmKW[i] << ',' << results.growth[i] << ','
+                << results.p1ShedCycles[i] << ',' << results.shedEvents[i] << ','
+                << results.servedFraction[i] << ',' << results.minMarginKW[i] << '\n';
+        return static_cast<bool>(csv);
+    }
 
-        for (auto src : sources) {
-            if (!breakers[src->getName()].isTripped()) {
-                src->simulate();
-                PowerSource* ps = dynamic_cast<PowerSource*>(src);
-                if (ps && src->isConnected()) totalPower += ps->getPowerOutput();
+    // For each (firm, growth) pair: the fewest solar units that never shed a priority-1 load
+    void printSummary(std::ostream& os) const {
+        os << "\n[Sweep Summary] " << results.size() << " jobs x " << spec.cycles << " cycles\n";
+        os << std::setw(10) << "firm(kW)" << std::setw(8) << "growth" << std::setw(14) << "extra solar"
+           << std::setw(12) << "served" << "\n";
+        for (size_t f = 0; f < spec.firmKW.size(); ++f) {
+            for (size_t g = 0; g < spec.growth.size(); ++g) {
+                int best = -1;
+                float bestServed = 0;
+                for (size_t s = 0; s < spec.solarUnits.size(); ++s) {
+                    size_t job = (s * spec.firmKW.size() + f) * spec.growth.size() + g;
+                    if (results.p1ShedCycles[job] == 0 && (best < 0 || results.solarUnits[job] < best)) {
+                        best = results.solarUnits[job];
+                        bestServed = results.servedFraction[job];
+                    }
+                }
+                os << std::setw(10) << spec.firmKW[f] << std::setw(8) << spec.growth[g];
+                if (best < 0) os << std::setw(14) << "none" << std::setw(12) << "-" << "\n";
+                else os << std::setw(14) << best << std::setw(11) << bestServed * 100.0f << "%\n";
             }
         }
+    }
+};
+
+// -------------------------
+// GridHost: Many independent grids sharing one scheduler
+// -------------------------
+// Each hosted grid is a silent, unrecorded GridManager with its own random
+// generator, so its results do not depend on which worker steps it or on what
+// the other grids do. Grids added from a common template share its column
+// chunks until they diverge. Lockstep stepping finishes a cycle on every grid
+// before any grid starts the next; independent stepping lets each batch of
+// grids run all its cycles without waiting for the rest.
+//
+// Grids may be linked by capacity-limited tie-lines. An interconnected cycle
+// measures every grid in parallel, clears surplus against deficit across the
+// ties on the calling thread, then balances every grid in parallel with its
+// net import, so a grid sheds only the deficit its neighbours could not cover.
+class GridHost {
+public:
+    struct TieLine {
+        size_t a, b;
+        float capacityKW;
+        float flowKW = 0;          // Last cycle's transfer; positive when a exports to b
+        double transferredKW = 0;  // Sum of |flowKW| over all cycles
+    };
+
+private:
+    struct Hosted {
+        std::unique_ptr<GridManager> grid;
+        std::minstd_rand rng;
+        uint64_t trips = 0;           // Loads shed since the grid was added
+        uint32_t p1ShedCycles = 0;    // Cycles that shed a priority-1 load
+    };
+    static constexpr size_t kGrain = 64;  // Grids per task: a small grid cycles in microseconds
 
-        for (const auto& l : loads) {
-            if (!breakers[l.getName()].isTripped()) {
-                l.simulate();
-                if (l.isConnected()) totalDemand += l.getRawDemand();
+    TaskScheduler& scheduler;
+    std::vector<Hosted> grids;
+    std::vector<TieLine> ties;
+    std::vector<float> net, imports;  // Per grid, reused across cycles
+
+    void account(Hosted& h) {
+        const CycleStats& cs = h.grid->getLastStats();
+        h.trips += cs.trips;
+        if (cs.minTripPriority >= 0 && cs.minTripPriority <= 1) ++h.p1ShedCycles;
+    }
+
+    void stepRange(size_t first, size_t last, uint32_t cycles) {
+        for (size_t g = first; g < last; ++g) {
+            Hosted& h = grids[g];
+            threadRng() = &h.rng;
+            for (uint32_t c = 0; c < cycles; ++c) {
+                h.grid->simulate();
+                account(h);
             }
         }
+        threadRng() = nullptr;
+    }
 
-        std::cout << "[Log] Total Power: " << totalPower << "kW\n";
-        std::cout << "[Log] Total Demand: " << totalDemand << "kW\n";
+    // Each tie moves min(capacity, exporter surplus, importer deficit), in tie
+    // order. Only directly tied grids trade; power is not wheeled through a third.
+    void exchange() {
+        TraceSpan span("tie-exchange", "control");
+        net.resize(grids.size());
+        imports.assign(grids.size(), 0.0f);
+        for (size_t g = 0; g < grids.size(); ++g)
+            net[g] = grids[g].grid->surplus();
+        for (TieLine& t : ties) {
+            float flow = 0;
+            if (net[t.a] > 0 && net[t.b] < 0) flow = std::min({t.capacityKW, net[t.a], -net[t.b]});
+            else if (net[t.b] > 0 && net[t.a] < 0) flow = -std::min({t.capacityKW, net[t.b], -net[t.a]});
+            net[t.a] -= flow;
+            net[t.b] += flow;
+            imports[t.a] -= flow;
+            imports[t.b] += flow;
+            t.flowKW = flow;
+            t.transferredKW += std::fabs(flow);
+        }
+    }
 
-        // Load shedding logic
-        if (totalPower < totalDemand) {
-            std::cout << "[Warning] Power Deficit Detected. Tripping loads based on priority.\n";
-            std::vector<Load*> sortedLoads;
-            for (auto& l : loads)
-                if (l.isConnected()) sortedLoads.push_back(&l);
-            std::sort(sortedLoads.begin(), sortedLoads.end(), [](Load* a, Load* b) {
-                return a->getPriority() > b->getPriority();
-            });
+public:
+    explicit GridHost(TaskScheduler& s) : scheduler(s) {}
+    GridHost(const GridHost&) = delete;
+    GridHost& operator=(const GridHost&) = delete;
 
-            for (auto* l : sortedLoads) {
-                l->disconnect();
-                breakers[l->getName()].trip();
-                std::cout << "[Trip] Load " << l->getName() << " tripped due to overload.\n";
-                totalDemand -= l->getRawDemand();
-                if (totalPower >= totalDemand) break;
-            }
-        } else {
-            // Reconnect loads in priority order
-            std::vector<Load*> disconnectedLoads;
-            for (auto& l : loads) {
-                if (!l.isConnected() && !breakers[l.getName()].isTripped())
-                    disconnectedLoads.push_back(&l);
-            }
-            std::sort(disconnectedLoads.begin(), disconnectedLoads.end(), [](Load* a, Load* b) {
-                return a->getPriority() < b->getPriority();
-            });
+    // O(1) in the size of `state`; returns the new grid's id
+    size_t add(const GridState& state, unsigned int seed) {
+        grids.push_back({std::make_unique<GridManager>(state), std::minstd_rand(seed)});
+        return grids.size() - 1;
+    }
+
+    size_t size() const { return grids.size(); }
+    GridManager& grid(size_t id) { return *grids[id].grid; }
+    uint64_t trips(size_t id) const { return grids[id].trips; }
+    uint32_t p1ShedCycles(size_t id) const { return grids[id].p1ShedCycles; }
+
+    void stepLockstep(uint32_t cycles) {
+        TraceSpan span("host-lockstep", "worker");
+        for (uint32_t c = 0; c < cycles; ++c)
+            scheduler.parallelFor(0, grids.size(), kGrain, [this](size_t b, size_t e) { stepRange(b, e, 1); });
+    }
+
+    void stepIndependent(uint32_t cycles) {
+        TraceSpan span("host-independent", "worker");
+        scheduler.parallelFor(0, grids.size(), kGrain, [this, cycles](size_t b, size_t e) { stepRange(b, e, cycles); });
+    }
+
+    // Links two grids; returns false for an unknown grid, a self-tie or a negative capacity
+    bool connect(size_t a, size_t b, float capacityKW) {
+        if (a >= grids.size() || b >= grids.size() || a == b || capacityKW < 0) return false;
+        ties.push_back({a, b, capacityKW});
+        return true;
+    }
+
+    const std::vector<TieLine>& tieLines() const { return ties; }
 
-            for (auto* l : disconnectedLoads) {
-                if (totalPower >= totalDemand + l->getRawDemand()) {
-                    l->reconnect();
-                    std::cout << "[Reconnect] Load " << l->getName() << " reconnected.\n";
-                    totalDemand += l->getRawDemand();
+    // Lockstep cycles with one cross-grid exchange between measuring and balancing
+    void stepInterconnected(uint32_t cycles) {
+        TraceSpan span("host-interconnected", "worker");
+        for (uint32_t c = 0; c < cycles; ++c) {
+            scheduler.parallelFor(0, grids.size(), kGrain, [this](size_t b, size_t e) {
+                for (size_t g = b; g < e; ++g) {
+                    threadRng() = &grids[g].rng;
+                    grids[g].grid->measure();
                 }
+                threadRng() = nullptr;
+            });
+            exchange();
+            scheduler.parallelFor(0, grids.size(), kGrain, [this](size_t b, size_t e) {
+                for (size_t g = b; g < e; ++g) {
+                    grids[g].grid->balance(imports[g]);
+                    account(grids[g]);
+                }
+            });
+        }
+    }
+};
+
+// -------------------------
+// RateScheduler: Control loops at their own periods on simulated time
+// -------------------------
+// Each loop has a period in simulated milliseconds and runs only when due.
+// Loops due at the same instant run in registration order, so register the
+// fastest first. advance() jumps from one due instant to the next, so a loop
+// costs only its own runs, and a cheap fast loop leaves throughput to the slow ones.
+class RateScheduler {
+public:
+    using Loop = std::function<void(uint64_t nowMs)>;
+
+private:
+    struct Entry {
+        std::string name;
+        uint64_t periodMs;
+        uint64_t nextMs;
+        Loop fn;
+        uint64_t runs = 0;
+        double busyMs = 0;
+    };
+    std::vector<Entry> loops;
+    uint64_t now = 0;
+
+public:
+    // First run is one period from now
+    void add(const std::string& name, uint64_t periodMs, Loop fn) {
+        periodMs = std::max<uint64_t>(1, periodMs);
+        loops.push_back({name, periodMs, now + periodMs, std::move(fn)});
+    }
+
+    uint64_t nowMs() const { return now; }
+
+    // Runs every loop due up to and including untilMs
+    void advance(uint64_t untilMs) {
+        for (;;) {
+            uint64_t next = std::numeric_limits<uint64_t>::max();
+            for (const Entry& e : loops)
+                next = std::min(next, e.nextMs);
+            if (next > untilMs) break;
+            now = next;
+            for (Entry& e : loops) {
+                if (e.nextMs != now) continue;
+                auto start = std::chrono::steady_clock::now();
+                e.fn(now);
+                e.busyMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                ++e.runs;
+                e.nextMs += e.periodMs;
             }
         }
+        now = std::max(now, untilMs);
+    }
+
+    void report(std::ostream& os) const {
+        os << "\n[Rates] " << now / 1000.0 << "s simulated\n";
+        os << std::left << std::setw(12) << "loop" << std::right << std::setw(12) << "period(ms)" << std::setw(12) << "runs"
+           << std::setw(14) << "wall(ms)" << std::setw(14) << "us/run" << "\n";
+        for (const Entry& e : loops)
+            os << std::left << std::setw(12) << e.name << std::right << std::setw(12) << e.periodMs << std::setw(12) << e.runs
+               << std::setw(14) << e.busyMs << std::setw(14) << (e.runs ? e.busyMs * 1000.0 / e.runs : 0.0) << "\n";
+    }
+};
+
+// -------------------------
+// ActorSystem: Lightweight message-passing actors on the task scheduler
+// -------------------------
+// An actor is a behavior plus a mailbox guarded by a one-byte spinlock. The
+// first message to an idle actor schedules it; when it runs it takes its whole
+// mailbox in one swap and handles the batch, so scheduling and locking are paid
+// per batch rather than per message. Messages sent from inside a behavior are
+// staged in a per-thread outbox and delivered after the batch, taking each
+// target's lock once per run of messages to it, and the actors a batch wakes
+// are queued as tasks of up to kWakeBatch activations each. Create actors
+// before running; spawn() is not thread-safe.
+class ActorSystem {
+public:
+    using ActorId = uint32_t;
+    struct Message {
+        ActorId from;
+        uint32_t kind;
+        float value;
+    };
+    using Behavior = std::function<void(ActorSystem&, ActorId self, const Message&)>;
+
+private:
+    struct Actor {
+        Behavior behavior;
+        std::vector<Message> mailbox;
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        bool scheduled = false;  // Guarded by lock
+
+        void acquire() {
+            while (lock.test_and_set(std::memory_order_acquire))
+                std::this_thread::yield();
+        }
+        void release() { lock.clear(std::memory_order_release); }
+    };
+    struct Outgoing {
+        ActorId to;
+        Message msg;
+    };
+    struct ThreadState {
+        ActorSystem* running = nullptr;  // System whose behavior this thread is executing
+        std::vector<Outgoing> outbox;
+        std::vector<Message> batch;
+        std::vector<ActorId> woken;
+    };
+    static constexpr size_t kWakeBatch = 256;
 
-        for (const auto& f : faults)
-            std::cout << "[Log] Active Fault: " << f << "\n";
+    TaskScheduler& scheduler;
+    std::unique_ptr<TaskScheduler::TaskGroup> group;
+    std::deque<Actor> actors;           // Stable addresses as actors are added
+    std::deque<ActorId> ready;          // Inline mode only
+    std::atomic<uint64_t> delivered{0};
 
-        std::cout << "[Log] Simulation End\n";
+    static ThreadState& local() {
+        thread_local ThreadState t;
+        return t;
     }
 
-    // -------------------
-    // Manual Fault Controls
-    // -------------------
-    void injectManualFault() {
-        std::cout << "Select target to fault:\n";
-        for (size_t i = 0; i < loads.size(); ++i)
-            std::cout << "L" << i << ": Load: " << loads[i].getName() << "\n";
-        for (size_t i = 0; i < sources.size(); ++i)
-            std::cout << "S" << i << ": Source: " << sources[i]->getName() << "\n";
-        std::string input;
-        std::cin >> input;
-        std::string name;
-        if (input[0] == 'L') name = loads[std::stoi(input.substr(1))].getName();
-        else if (input[0] == 'S') name = sources[std::stoi(input.substr(1))]->getName();
-        faults.insert(name);
-        breakers[name].trip();
-        std::cout << "[Fault] Injected at " << name << "\n";
+    void schedule(const ActorId* first, const ActorId* last) {
+        if (scheduler.inlineMode()) {
+            ready.insert(ready.end(), first, last);
+            return;
+        }
+        for (; first < last; first += kWakeBatch) {
+            std::vector<ActorId> ids(first, std::min(last, first + kWakeBatch));
+            group->run([this, ids = std::move(ids)]() {
+                for (ActorId id : ids)
+                    activate(id);
+            });
+        }
     }
 
-    void resolveManualFault() {
-        std::cout << "Active faults:\n";
-        int i = 0;
-        for (const auto& f : faults)
-            std::cout << i++ << ": " << f << "\n";
-        int index;
-        std::cin >> index;
-        auto it = faults.begin();
-        std::advance(it, index);
-        breakers[*it].reset();
-        faults.erase(it);
-        std::cout << "[Fault] Resolved: " << *it << "\n";
-        simulate();
+    // Appends a run of messages for one actor under a single lock acquisition;
+    // true if the actor was idle and now needs scheduling
+    bool deliver(ActorId to, const Outgoing* first, const Outgoing* last) {
+        Actor& a = actors[to];
+        a.acquire();
+        for (const Outgoing* o = first; o != last; ++o)
+            a.mailbox.push_back(o->msg);
+        bool wake = !a.scheduled;
+        a.scheduled = true;
+        a.release();
+        return wake;
     }
 
-    void disconnectLoad(size_t index) { loads[index].disconnect(); }
-    void reconnectLoad(size_t index) { loads[index].reconnect(); }
-    void showBreakers() const {
-        std::cout << "\n[Breaker Status]\n";
-        for (const auto& [k, b] : breakers)
-            std::cout << k << ": " << (b.isTripped() ? "TRIPPED" : "OK") << "\n";
+    void activate(ActorId id) {
+        ThreadState& t = local();
+        ActorSystem* outer = t.running;
+        t.running = this;
+        Actor& a = actors[id];
+        a.acquire();
+        t.batch.swap(a.mailbox);
+        a.release();
+        for (const Message& m : t.batch)
+            a.behavior(*this, id, m);
+        delivered.fetch_add(t.batch.size(), std::memory_order_relaxed);
+        t.batch.clear();
+        t.running = outer;
+        flush(t);
+        a.acquire();
+        bool more = !a.mailbox.empty();
+        if (!more) a.scheduled = false;
+        a.release();
+        if (more) schedule(&id, &id + 1);  // Back of the queue, so busy actors cannot starve others
+    }
+
+    void flush(ThreadState& t) {
+        const std::vector<Outgoing>& out = t.outbox;
+        for (size_t i = 0; i < out.size();) {
+            size_t j = i + 1;
+            while (j < out.size() && out[j].to == out[i].to) ++j;
+            if (deliver(out[i].to, out.data() + i, out.data() + j)) t.woken.push_back(out[i].to);
+            i = j;
+        }
+        t.outbox.clear();
+        schedule(t.woken.data(), t.woken.data() + t.woken.size());
+        t.woken.clear();
     }
-    const std::vector<Load>& getLoads() const { return loads; }
+
+public:
+    explicit ActorSystem(TaskScheduler& s) : scheduler(s), group(std::make_unique<TaskScheduler::TaskGroup>(s)) {}
+    ActorSystem(const ActorSystem&) = delete;
+    ActorSystem& operator=(const ActorSystem&) = delete;
+
+    ActorId spawn(Behavior behavior) {
+        actors.emplace_back();
+        actors.back().behavior = std::move(behavior);
+        return static_cast<ActorId>(actors.size() - 1);
+    }
+
+    void send(ActorId to, const Message& msg) {
+        ThreadState& t = local();
+        if (t.running == this) {
+            t.outbox.push_back({to, msg});
+            return;
+        }
+        Outgoing o{to, msg};
+        if (deliver(to, &o, &o + 1)) schedule(&to, &to + 1);
+    }
+
+    // Runs until every mailbox is empty and no activation is pending
+    void runUntilIdle() {
+        TraceSpan span("actors", "worker");
+        if (!scheduler.inlineMode()) {
+            group->wait();
+            return;
+        }
+        while (!ready.empty()) {
+            ActorId id = ready.front();
+            ready.pop_front();
+            activate(id);
+        }
+    }
+
+    size_t size() const { return actors.size(); }
+    uint64_t messagesDelivered() const { return delivered.load(); }
 };
 
 // -------------------------
-// Operator Overloading
+// ActorStudy: Decentralized under-frequency load shedding with actors
 // -------------------------
-std::ostream& operator<<(std::ostream& os, const Load& load) {
-    os << "[Load] " << load.getName() << ": " << load.getRawDemand() << "kW, Priority: "
-       << load.getPriority() << ", Connected: " << (load.isConnected() ? "Yes" : "No");
-    return os;
+// Each round the controller compares capacity with the demand reported last
+// round and broadcasts the deviation through feeder actors to every load. Each
+// load acts on its own, like a relay: priority p trips below -5% * (5 - p) and
+// reconnects above +2% * p. It then reports its draw, and feeders sum reports
+// back to the controller. A round is about two messages per load.
+inline void runActorStudy(size_t loads, uint32_t rounds, TaskScheduler& scheduler, std::ostream& os) {
+    using ActorId = ActorSystem::ActorId;
+    using Message = ActorSystem::Message;
+    enum Kind : uint32_t { Signal, Report };
+    constexpr size_t kFanout = 1024;  // Loads per feeder
+
+    struct Study {
+        size_t feeders = 0;
+        std::vector<uint8_t> connected;
+        std::vector<float> feederSum;
+        std::vector<uint32_t> feederPending;
+        float demand = 0, roundDemand = 0;
+        size_t controllerPending = 0;
+    } study;
+    study.feeders = (loads + kFanout - 1) / kFanout;
+    study.connected.assign(loads, 1);
+    study.feederSum.assign(study.feeders, 0.0f);
+    study.feederPending.assign(study.feeders, 0);
+    study.demand = static_cast<float>(loads);  // 1 kW each
+
+    ActorSystem actors(scheduler);
+    const ActorId firstFeeder = 1, firstLoad = static_cast<ActorId>(1 + study.feeders);
+    actors.spawn([&study, firstFeeder](ActorSystem& sys, ActorId self, const Message& m) {
+        if (m.kind == Signal) {  // From outside: value is this round's capacity
+            float deviation = study.demand > 0 ? (m.value - study.demand) / study.demand : 1.0f;
+            study.roundDemand = 0;
+            study.controllerPending = study.feeders;
+            for (size_t f = 0; f < study.feeders; ++f)
+                sys.send(firstFeeder + static_cast<ActorId>(f), {self, Signal, deviation});
+        } else {
+            study.roundDemand += m.value;
+            if (--study.controllerPending == 0) study.demand = study.roundDemand;
+        }
+    });
+    for (size_t f = 0; f < study.feeders; ++f) {
+        actors.spawn([&study, f, loads, firstLoad](ActorSystem& sys, ActorId self, const Message& m) {
+            const size_t first = f * kFanout, last = std::min(loads, first + kFanout);
+            if (m.kind == Signal) {
+                study.feederSum[f] = 0;
+                study.feederPending[f] = static_cast<uint32_t>(last - first);
+                for (size_t i = first; i < last; ++i)
+                    sys.send(firstLoad + static_cast<ActorId>(i), {self, Signal, m.value});
+            } else {
+                study.feederSum[f] += m.value;
+                if (--study.feederPending[f] == 0) sys.send(0, {self, Report, study.feederSum[f]});
+            }
+        });
+    }
+    for (size_t i = 0; i < loads; ++i) {
+        actors.spawn([&study, i](ActorSystem& sys, ActorId self, const Message& m) {
+            const int priority = static_cast<int>(i % 5) + 1;
+            if (m.value < -0.05f * (5 - priority)) study.connected[i] = 0;
+            else if (m.value > 0.02f * priority) study.connected[i] = 1;
+            sys.send(m.from, {self, Report, study.connected[i] ? 1.0f : 0.0f});
+        });
+    }
+
+    uint32_t overloaded = 0;
+    double servedShare = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t r = 0; r < rounds; ++r) {
+        float capacity = static_cast<float>(loads) * (0.8f + 0.3f * std::sin(0.5f * static_cast<float>(r)));
+        actors.send(0, {0, Signal, capacity});
+        actors.runUntilIdle();
+        if (study.demand > capacity) ++overloaded;
+        servedShare += capacity > 0 ? std::min(1.0f, study.demand / capacity) : 0.0f;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    uint64_t messages = actors.messagesDelivered();
+    os << "[Actors] " << actors.size() << " actors, " << rounds << " rounds, " << messages << " messages on "
+       << std::max<size_t>(1, scheduler.workerCount()) << " workers in " << ms << "ms ("
+       << (ms > 0 ? messages / ms / 1000.0 : 0.0) << " M msg/s)\n";
+    os << "[Actors] Capacity used " << (rounds ? 100.0 * servedShare / rounds : 0.0) << "% on average, "
+       << overloaded << " rounds ended overloaded\n";
 }
 
-std::ostream& operator<<(std::ostream& os, const PowerSource& source) {
-    os << "[Source] " << source.getName() << ": " << source.getPowerOutput() << "kW";
-    return os;
+// -------------------------
+// Benchmark: Synthetic large grid for measuring cycle cost
+// -------------------------
+// Builds `loads` 1 kW loads with mixed priorities and enough firm capacity to
+// serve them, then times silent cycles serially and on the scheduler. With
+// --huge-pages the serial run is first repeated on a heap-backed copy of the
+// grid so the dTLB-miss difference can be reported.
+inline void runBenchmark(size_t loads, uint32_t cycles, TaskScheduler& scheduler, std::ostream& os) {
+    auto build = [loads]() {
+        auto grid = std::make_unique<GridManager>(GridState{});
+        GridTransaction tx;
+        for (size_t i = 0; i < loads; ++i)
+            tx.addLoad(Load("Bench-" + std::to_string(i), 1.0f, static_cast<int>(i % 5) + 1));
+        tx.addSource(new SolarSource("Bench-Solar"));
+        tx.addSource(new PowerSource("Bench-Firm", static_cast<float>(loads) * 1.1f, false));
+        std::string error;
+        grid->commit(tx, error);
+        return grid;
+    };
+    // Returns dTLB load misses per cycle on this thread, or -1 without counters
+    auto timeCycles = [&](GridManager& grid, const char* label) {
+        int tlb = PerfCounters::openTlbMissCounter();
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t c = 0; c < cycles; ++c)
+            grid.simulate();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        double misses = -1;
+        uint64_t count = 0;
+        if (tlb >= 0 && ::read(tlb, &count, sizeof(count)) == static_cast<ssize_t>(sizeof(count)))
+            misses = static_cast<double>(count) / cycles;
+        if (tlb >= 0) ::close(tlb);
+        os << "[Bench] " << std::left << std::setw(10) << label << std::right << ms / cycles << " ms/cycle, "
+           << (loads ? ms * 1e6 / (static_cast<double>(cycles) * loads) : 0.0) << " ns/load";
+        if (misses >= 0) os << ", " << misses << " dTLB misses/cycle";
+        os << "\n";
+        return misses;
+    };
+
+    os << "[Bench] " << loads << " loads, " << cycles << " cycles per run\n";
+    os << "[Bench] " << NumaTopology::instance().nodeCount() << " NUMA node(s), one load shard per node\n";
+    ChunkArena& arena = ChunkArena::instance();
+    const ChunkArena::Mode mode = arena.getMode();
+    double heapMisses = -1;
+    if (mode != ChunkArena::Mode::Off) {
+        arena.setMode(ChunkArena::Mode::Off);
+        auto heapGrid = build();
+        heapGrid->setFullRecompute(true);  // Same full scan as the "serial" run it is compared with
+        heapMisses = timeCycles(*heapGrid, "heap");
+        arena.setMode(mode);
+    }
+
+    auto buildStart = std::chrono::steady_clock::now();
+    auto grid = build();
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+    os << "[Bench] Grid built in " << buildMs << "ms\n";
+    grid->setFullRecompute(true);
+    double serialMisses = timeCycles(*grid, "serial");
+    const float fullDemand = grid->getTotalDemand();
+    if (mode != ChunkArena::Mode::Off) {
+        ChunkArena::Usage u = arena.usage();
+        os << "[Bench] Huge pages: " << u.regions << " region(s), " << (u.mappedBytes >> 20) << " MB mapped, "
+           << u.explicitPages << " explicit + " << u.transparentPages << " transparent 2 MB pages\n";
+        if (heapMisses > 0 && serialMisses >= 0)
+            os << "[Bench] dTLB misses vs heap: " << std::fixed << std::setprecision(1)
+               << 100.0 * (1.0 - serialMisses / heapMisses) << "% fewer\n" << std::defaultfloat << std::setprecision(6);
+        else
+            os << "[Bench] dTLB counters unavailable; no miss comparison\n";
+    }
+    // Nothing changes between bench cycles, so with dirty tracking only the
+    // fluctuating source is recomputed and the load chunks are not rescanned
+    grid->setFullRecompute(GridManager::fullRecomputeDefault());
+    timeCycles(*grid, "memoized");
+    os << "[Bench] Memoized demand " << (grid->getTotalDemand() == fullDemand ? "matches" : "DIFFERS from")
+       << " full recompute\n";
+    if (!scheduler.inlineMode()) {
+        grid->setFullRecompute(true);
+        grid->setScheduler(&scheduler);
+        std::string label = std::to_string(scheduler.workerCount()) + " workers";
+        timeCycles(*grid, label.c_str());
+    }
+    // Memoized cycles cost next to nothing, so this measures the smoothing kernel
+    grid->setScheduler(nullptr);
+    grid->setFullRecompute(GridManager::fullRecomputeDefault());
+    grid->enableForecast(0.5f, 0.1f);
+    timeCycles(*grid, "forecast");
+
+    // The same loads as one class per priority: five rows instead of `loads`
+    grid.reset();
+    buildStart = std::chrono::steady_clock::now();
+    GridManager classGrid(GridState{});
+    classGrid.addSource(new SolarSource("Bench-Solar"));  // Sources first: adding one runs a cycle
+    classGrid.addSource(new PowerSource("Bench-Firm", static_cast<float>(loads) * 1.1f, false));
+    for (int p = 1; p <= 5; ++p)
+        classGrid.addClass("Bench-P" + std::to_string(p), 1.0f, p, static_cast<uint32_t>(loads / 5 + (static_cast<size_t>(p - 1) < loads % 5)));
+    buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+    os << "[Bench] Class grid built in " << buildMs << "ms\n";
+    classGrid.setFullRecompute(true);
+    timeCycles(classGrid, "classes");
+    os << "[Bench] Class demand " << (classGrid.getTotalDemand() == fullDemand ? "matches" : "differs from")
+       << " the per-load grid\n";
+
+    // Every load enrolled for demand response at scattered prices, a quarter
+    // of them shiftable, with supply 2% short even at peak solar: each cycle
+    // calls on the cheapest offers instead of shedding. The first cycle sorts
+    // the curve.
+    grid = build();
+    buildStart = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loads; ++i)
+        grid->enroll(i, 0.5f, static_cast<float>((i * 2654435761u) % 1000) / 10.0f, 1e9f, i % 4 ? 0 : 8);
+    grid->addSource(new PowerSource("Bench-Short", std::max(0.0f, static_cast<float>(loads) * 0.98f - 50.0f), false));
+    grid->injectFault("Bench-Firm");
+    grid->simulate();
+    buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+    os << "[Bench] " << loads << " loads enrolled and bid curve sorted in " << buildMs << "ms\n";
+    timeCycles(*grid, "response");
+    os << "[Bench] Demand response relieved " << grid->getLastStats().responded << "kW last cycle, "
+       << grid->getLastStats().trips << " load(s) shed\n";
 }
 
+// -------------------------
+// SessionInput: Operator input that can be journaled and replayed
+// -------------------------
+// A journal is a header line "SGSJOURNAL 1 <seed>" followed by every input
+// line exactly as the operator typed it. Lines are flushed as they are read,
+// so a session that crashes still leaves a replayable journal.
+class SessionInput : public std::streambuf {
+    std::istream* source;
+    std::ifstream replayFile;
+    std::ofstream journal;
+    std::string line;
+
+    int_type underflow() override {
+        if (!std::getline(*source, line)) return traits_type::eof();
+        line.push_back('\n');
+        if (journal.is_open()) journal << line << std::flush;
+        setg(&line[0], &line[0], &line[0] + line.size());
+        return traits_type::to_int_type(line[0]);
+    }
+
+public:
+    SessionInput() : source(&std::cin) {}
+
+    bool record(const std::string& path, unsigned int seed) {
+        journal.open(path, std::ios::trunc);
+        if (!journal) return false;
+        journal << "SGSJOURNAL 1 " << seed << "\n" << std::flush;
+        return true;
+    }
+
+    bool replay(const std::string& path, unsigned int& seed) {
+        replayFile.open(path);
+        std::string magic;
+        int version = 0;
+        if (!(replayFile >> magic >> version >> seed) || magic != "SGSJOURNAL" || version != 1) return false;
+        replayFile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        source = &replayFile;
+        return true;
+    }
+};
+
 } // namespace SmartGrid
 
 // -------------------------
 // Main Application Entry
 // -------------------------
-int main() {
-    std::srand(static_cast<unsigned int>(std::time(nullptr)));
+int main(int argc, char* argv[]) {
     using namespace SmartGrid;
+    unsigned int seed = static_cast<unsigned int>(std::time(nullptr));
+
+    int modbusPort = -1;
+    std::string tracePath;
+    bool perf = false;
+    std::string recorderPath;
+    uint64_t recorderEvents = 1 << 16;
+    std::string journalPath, replayPath;
+    bool quiet = false;
+    std::string scriptPath;
+    size_t undoDepth = 64;
+    std::string sweepSpec, sweepOut;
+    int workerThreads = -1;  // -1: one per extra core
+    bool pinThreads = false;
+    size_t benchLoads = 0;
+    uint32_t benchCycles = 20;
+    ChunkArena::Mode hugePages = ChunkArena::Mode::Off;
+    bool fullRecompute = false;
+    float forecastAlpha = 0, forecastBeta = 0.1f;  // alpha 0: no forecasting
+    uint32_t mpcHorizon = 0;
+    double mpcBudgetMs = 2.0;
+    size_t hostGrids = 0;
+    uint32_t hostCycles = 100;
+    bool hostIndependent = false;
+    float tieKW = -1;  // < 0: hosted grids are not interconnected
+    size_t actorLoads = 0;
+    double multirateSeconds = 0;
+    uint64_t rates[3] = {1, 4000, 900000};  // Protection, dispatch and planning periods in ms
+    uint32_t actorRounds = 50;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--modbus" && i + 1 < argc) modbusPort = std::atoi(argv[++i]);
+        else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+        else if (arg == "--perf") perf = true;
+        else if (arg == "--recorder" && i + 1 < argc) recorderPath = argv[++i];
+        else if (arg == "--recorder-events" && i + 1 < argc) recorderEvents = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--dump-recorder" && i + 1 < argc) {
+            if (FlightRecorder::dump(argv[++i], std::cout)) return 0;
+            std::cout << "[Recorder] Not a flight recorder file: " << argv[i] << "\n";
+            return 1;
+        }
+        else if (arg == "--seed" && i + 1 < argc) seed = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--record" && i + 1 < argc) journalPath = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc) replayPath = argv[++i];
+        else if (arg == "--quiet") quiet = true;
+        else if (arg == "--undo-depth" && i + 1 < argc) undoDepth = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--script" && i + 1 < argc) scriptPath = argv[++i];
+        else if (arg == "--sweep" && i + 1 < argc) sweepSpec = argv[++i];
+        else if (arg == "--sweep-out" && i + 1 < argc) sweepOut = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc) workerThreads = std::atoi(argv[++i]);
+        else if (arg == "--pin") pinThreads = true;
+        else if (arg == "--bench" && i + 1 < argc) benchLoads = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--host" && i + 1 < argc) hostGrids = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--host-cycles" && i + 1 < argc) hostCycles = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--host-independent") hostIndependent = true;
+        else if (arg == "--multirate" && i + 1 < argc) multirateSeconds = std::atof(argv[++i]);
+        else if (arg == "--rates" && i + 1 < argc) {
+            std::istringstream list(argv[++i]);
+            std::string item;
+            for (int r = 0; r < 3 && std::getline(list, item, ','); ++r)
+                rates[r] = std::strtoull(item.c_str(), nullptr, 10);
+        }
+        else if (arg == "--actors" && i + 1 < argc) actorLoads = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--actor-rounds" && i + 1 < argc) actorRounds = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--tie" && i + 1 < argc) tieKW = static_cast<float>(std::atof(argv[++i]));
+        else if (arg == "--huge-pages" && i + 1 < argc) {
+            std::string m = argv[++i];
+            hugePages = m == "explicit" ? ChunkArena::Mode::Explicit
+                      : m == "thp" ? ChunkArena::Mode::Transparent : ChunkArena::Mode::Off;
+        }
+        else if (arg == "--full-recompute") fullRecompute = true;
+        else if (arg == "--mpc" && i + 1 < argc) mpcHorizon = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--mpc-budget" && i + 1 < argc) mpcBudgetMs = std::atof(argv[++i]);
+        else if (arg == "--forecast" && i + 1 < argc) {
+            char* rest = nullptr;
+            forecastAlpha = std::strtof(argv[++i], &rest);
+            if (*rest == ',') forecastBeta = std::strtof(rest + 1, nullptr);
+        }
+        else if (arg == "--bench-cycles" && i + 1 < argc) benchCycles = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+    }
+
+    SessionInput session;
+    if (!replayPath.empty()) {
+        if (!session.replay(replayPath, seed)) {
+            std::cout << "[Replay] Not a session journal: " << replayPath << "\n";
+            return 1;
+        }
+        quiet = true;  // Replays run at full speed without prompts
+    }
+    if (!journalPath.empty() && !session.record(journalPath, seed))
+        std::cout << "[Journal] Could not write " << journalPath << "\n";
+    std::istream input(&session);
+    std::ostream nullOut(nullptr);
+    std::ostream& ui = quiet ? nullOut : std::cout;  // Prompts only; simulation output stays on std::cout
+    std::srand(seed);
+    if (!recorderPath.empty() && !FlightRecorder::instance().open(recorderPath, recorderEvents))
+        std::cout << "[Recorder] Could not map " << recorderPath << "\n";
+    if (perf && !PerfCounters::instance().enable())
+        std::cout << "[Perf] Hardware counters unavailable (check perf_event_paranoid).\n";
+    if (!tracePath.empty()) Tracer::instance().enable();
+
+    // Reports for --perf and --trace, written however the run ends
+    auto writeReports = [&tracePath]() {
+        if (PerfCounters::instance().enabled()) PerfCounters::instance().report(std::cout);
+        if (tracePath.empty()) return;
+        if (Tracer::instance().writeChromeJson(tracePath))
+            std::cout << "[Trace] Written to " << tracePath << "\n";
+        else
+            std::cout << "[Trace] Could not write " << tracePath << "\n";
+    };
+
+    ChunkArena::instance().setMode(hugePages);  // Before any grid state is allocated
+    GridManager::fullRecomputeDefault() = fullRecompute;
+    if (workerThreads < 0) workerThreads = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+    TaskScheduler scheduler(static_cast<unsigned int>(std::max(0, workerThreads)), pinThreads);
+    if (benchLoads > 0) {
+        runBenchmark(benchLoads, std::max<uint32_t>(1, benchCycles), scheduler, std::cout);
+        writeReports();
+        return 0;
+    }
+    if (actorLoads > 0) {
+        runActorStudy(actorLoads, std::max<uint32_t>(1, actorRounds), scheduler, std::cout);
+        writeReports();
+        return 0;
+    }
 
     GridManager gm;
+    gm.setHistoryLimit(undoDepth);
+    gm.setScheduler(&scheduler);
+    if (forecastAlpha > 0) gm.enableForecast(std::min(forecastAlpha, 1.0f), std::min(std::max(forecastBeta, 0.0f), 1.0f));
+    gm.enableMpc(mpcHorizon, mpcBudgetMs);
+    std::unique_ptr<ModbusServer> modbus;
+    if (modbusPort > 0 && modbusPort < 65536) {
+        modbus.reset(new ModbusServer(gm, static_cast<uint16_t>(modbusPort)));
+        if (modbus->start()) gm.addObserver(modbus.get());
+        else std::cout << "[Modbus] Could not bind 127.0.0.1:" << modbusPort << "\n";
+    }
     gm.addSource(new SolarSource("SolarFarm-A"));
     gm.addSource(new PowerSource("HydroStation", 60.0f, false));
     gm.addLoad(Load("Factory-A", 30, 2));
     gm.addLoad(Load("House-B", 15, 1));
     gm.addLoad(Load("Shop-C", 10, 3));
 
+    if (!sweepSpec.empty()) {
+        ParameterSweep::Spec spec;
+        std::string error;
+        if (!spec.parse(sweepSpec, error)) {
+            std::cout << "[Sweep] " << error << "\n";
+            return 1;
+        }
+        ParameterSweep sweep(gm.getState(), spec);
+        auto start = std::chrono::steady_clock::now();
+        sweep.run(scheduler);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[Sweep] " << spec.jobs() << " jobs on " << std::max<size_t>(1, scheduler.workerCount())
+                  << " workers in " << ms << "ms\n";
+        sweep.printSummary(std::cout);
+        if (!sweepOut.empty() && !sweep.writeCsv(sweepOut))
+            std::cout << "[Sweep] Could not write " << sweepOut << "\n";
+        if (modbus) modbus->stop();
+        writeReports();
+        return 0;
+    }
+
+    if (hostGrids > 0) {
+        auto residentKB = []() {
+            std::ifstream statm("/proc/self/statm");
+            size_t pages = 0, resident = 0;
+            statm >> pages >> resident;
+            return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE)) / 1024;
+        };
+        size_t before = residentKB();
+        GridHost host(scheduler);
+        const bool tied = tieKW >= 0;
+        for (size_t g = 0; g < hostGrids; ++g) {
+            size_t id = host.add(gm.getState(), seed + static_cast<unsigned int>(g));
+            if (tied && g % 2 == 0) host.grid(id).scaleDemand(2.0f);  // Heavy grids next to light ones
+        }
+        if (tied) {
+            // A ring; two grids get a single tie
+            for (size_t g = 0; g + 1 < hostGrids || (hostGrids > 2 && g + 1 == hostGrids); ++g)
+                host.connect(g, (g + 1) % hostGrids, tieKW);
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (tied) host.stepInterconnected(hostCycles);
+        else if (hostIndependent) host.stepIndependent(hostCycles);
+        else host.stepLockstep(hostCycles);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        size_t after = residentKB();
+        uint64_t trips = 0;
+        size_t p1Grids = 0;
+        for (size_t g = 0; g < host.size(); ++g) {
+            trips += host.trips(g);
+            if (host.p1ShedCycles(g)) ++p1Grids;
+        }
+        std::cout << "[Host] " << hostGrids << " grids x " << hostCycles << " cycles ("
+                  << (tied ? "interconnected" : hostIndependent ? "independent" : "lockstep") << ") on "
+                  << std::max<size_t>(1, scheduler.workerCount()) << " workers in " << ms << "ms, "
+                  << (ms > 0 ? hostGrids * static_cast<double>(hostCycles) * 1000.0 / ms : 0.0) << " grid-cycles/s\n";
+        std::cout << "[Host] Resident memory: " << (after > before ? (after - before) * 1024 / hostGrids : 0)
+                  << " bytes per grid\n";
+        std::cout << "[Host] " << trips << " loads shed, " << p1Grids << " grids shed a priority-1 load\n";
+        if (tied) {
+            double transferred = 0;
+            for (const auto& t : host.tieLines())
+                transferred += t.transferredKW;
+            std::cout << "[Host] " << host.tieLines().size() << " tie-lines of " << tieKW << "kW carried "
+                      << transferred / hostCycles << "kW per cycle in total\n";
+        }
+        if (modbus) modbus->stop();
+        writeReports();
+        return 0;
+    }
+
+    if (multirateSeconds > 0) {
+        // Dispatch cycles run silently; planning prints a summary of each window
+        gm.setOutput(nullptr);
+        double demandSum = 0;
+        float peak = 0;
+        uint32_t cycles = 0, shed = 0;
+        RateScheduler rateLoops;
+        rateLoops.add("protection", rates[0], [&gm](uint64_t) { gm.protect(); });
+        rateLoops.add("dispatch", rates[1], [&](uint64_t) {
+            gm.simulate();
+            const CycleStats& cs = gm.getLastStats();
+            demandSum += cs.demand;
+            peak = std::max(peak, cs.demand);
+            shed += cs.trips;
+            ++cycles;
+        });
+        rateLoops.add("planning", rates[2], [&](uint64_t nowMs) {
+            std::cout << "[Plan] t=" << nowMs / 1000 << "s: " << cycles << " dispatch cycles, average demand "
+                      << (cycles ? demandSum / cycles : 0.0) << "kW, peak " << peak << "kW, " << shed << " loads shed";
+            if (const DemandForecast* f = gm.getForecast()) {
+                const uint32_t ahead = static_cast<uint32_t>(rates[2] / std::max<uint64_t>(1, rates[1]));
+                std::cout << ", next window " << f->demandAhead(ahead) << "kW demand / " << f->solarAhead(ahead) << "kW solar";
+            }
+            std::cout << "\n";
+            demandSum = 0;
+            peak = 0;
+            cycles = shed = 0;
+        });
+        rateLoops.advance(static_cast<uint64_t>(multirateSeconds * 1000.0));
+        rateLoops.report(std::cout);
+        gm.reportDispatch(std::cout);
+        if (modbus) modbus->stop();
+        writeReports();
+        return 0;
+    }
+
+    if (!scriptPath.empty()) {
+        ScenarioScript script;
+        std::ifstream file(scriptPath);
+        std::string error;
+        if (!file) error = "cannot open " + scriptPath;
+        bool ok = error.empty() && script.compile(file, error) && script.run(gm, std::cout);
+        if (!error.empty()) std::cout << "[Script] " << error << "\n";
+        gm.reportDispatch(std::cout);
+        if (modbus) modbus->stop();
+        writeReports();
+        return ok ? 0 : 1;
+    }
+
     int choice;
     do {
-        std::cout << "\n=== Smart Grid Menu ===\n";
-        std::cout << "1. Run simulation cycle\n2. Inject fault\n3. Resolve fault\n";
-        std::cout << "4. Disconnect load\n5. Reconnect load\n6. Show breaker states\n";
-        std::cout << "7. Add new load\n8. Add new source\n0. Exit\nEnter choice: ";
-        std::cin >> choice;
+        ui << "\n=== Smart Grid Menu ===\n";
+        ui << "1. Run simulation cycle\n2. Inject fault\n3. Resolve fault\n";
+        ui << "4. Disconnect load\n5. Reconnect load\n6. Show breaker states\n";
+        ui << "7. Add new load\n8. Add new source\n9. Undo last action\n10. Redo\n0. Exit\nEnter choice: ";
+        if (!(input >> choice)) break;  // End of input or journal
 
+        static const char* const commandNames[] = {"cmd-exit", "cmd-simulate", "cmd-inject-fault",
+            "cmd-resolve-fault", "cmd-disconnect", "cmd-reconnect", "cmd-show-breakers",
+            "cmd-add-load", "cmd-add-source", "cmd-undo", "cmd-redo"};
+        static const char* const actionNames[] = {"", "", "Inject fault", "Resolve fault", "Disconnect load",
+            "Reconnect load", "", "Add new load", "Add new source"};
+        TraceSpan commandSpan(choice >= 0 && choice <= 10 ? commandNames[choice] : "cmd-invalid", "control");
+        if ((choice >= 2 && choice <= 5) || choice == 7 || choice == 8) gm.checkpoint(actionNames[choice]);
         if (choice == 1) gm.simulate();
-        else if (choice == 2) gm.injectManualFault();
-        else if (choice == 3) gm.resolveManualFault();
+        else if (choice == 2) gm.injectManualFault(input, ui);
+        else if (choice == 3) gm.resolveManualFault(input, ui);
         else if (choice == 4) {
-            const auto& loads = gm.getLoads();
-            for (size_t i = 0; i < loads.size(); ++i)
-                std::cout << i << ": " << loads[i].getName() << std::endl;
+            for (size_t i = 0; i < gm.loadCount(); ++i)
+                ui << i << ": " << gm.loadName(i) << std::endl;
             size_t index;
-            std::cin >> index;
+            input >> index;
             gm.disconnectLoad(index);
         }
         else if (choice == 5) {
-            const auto& loads = gm.getLoads();
-            for (size_t i = 0; i < loads.size(); ++i)
-                std::cout << i << ": " << loads[i].getName() << std::endl;
+            for (size_t i = 0; i < gm.loadCount(); ++i)
+                ui << i << ": " << gm.loadName(i) << std::endl;
             size_t index;
-            std::cin >> index;
+            input >> index;
             gm.reconnectLoad(index);
         }
         else if (choice == 6) gm.showBreakers();
@@ -292,22 +5372,31 @@ int main() {
             std::string name;
             float demand;
             int priority;
-            std::cin >> name >> demand >> priority;
+            input >> name >> demand >> priority;
             gm.addLoad(Load(name, demand, priority));
         }
         else if (choice == 8) {
             std::string name;
             float power;
             int type;
-            std::cin >> name >> power >> type;
+            input >> name >> power >> type;
             if (type == 1)
                 gm.addSource(new SolarSource(name));
             else
                 gm.addSource(new PowerSource(name, power, (type == 2 || type == 3)));
         }
+        else if (choice == 9) {
+            if (!gm.undo()) std::cout << "Nothing to undo.\n";
+        }
+        else if (choice == 10) {
+            if (!gm.redo()) std::cout << "Nothing to redo.\n";
+        }
         else if (choice == 0) std::cout << "Exiting simulation.\n";
         else std::cout << "Invalid choice.\n";
+        gm.endAction();
     } while (choice != 0);
 
+    if (modbus) modbus->stop();
+    writeReports();
     return 0;
 }